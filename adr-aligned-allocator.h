@@ -0,0 +1,85 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#ifndef ADR_ALIGNED_ALLOCATOR_H
+#define ADR_ALIGNED_ALLOCATOR_H
+
+#include <cstdlib>
+#include <new>
+#include <stddef.h>
+
+namespace ns3 {
+
+  ///////////////////////////////////////
+  // Allocator of cache aligned memory //
+  ///////////////////////////////////////
+
+  //Allocator of memory aligned to Alignment bytes, for the containers of
+  //the AdrComponent whose elements must start on a cache line. Before
+  //C++17, std::allocator ignores the alignment of over-aligned types.
+  template <class T, size_t Alignment = 64>
+  class AdrAlignedAllocator
+  {
+    public:
+
+      typedef T value_type;
+
+      template <class U>
+      struct rebind
+      {
+        typedef AdrAlignedAllocator<U, Alignment> other;
+      };
+
+      AdrAlignedAllocator () {}
+
+      template <class U>
+      AdrAlignedAllocator (const AdrAlignedAllocator<U, Alignment> &) {}
+
+      T *allocate (size_t n)
+      {
+        void *p = 0;
+        if(posix_memalign (&p, Alignment, n * sizeof (T) > 0 ? n * sizeof (T) : 1) != 0)
+          throw std::bad_alloc ();
+
+        return static_cast<T *> (p);
+      }
+
+      void deallocate (T *p, size_t n)
+      {
+        free (p);
+      }
+  };
+
+  template <class T, class U, size_t Alignment>
+  bool operator== (const AdrAlignedAllocator<T, Alignment> &,
+                   const AdrAlignedAllocator<U, Alignment> &)
+  {
+    return true;
+  }
+
+  template <class T, class U, size_t Alignment>
+  bool operator!= (const AdrAlignedAllocator<T, Alignment> &,
+                   const AdrAlignedAllocator<U, Alignment> &)
+  {
+    return false;
+  }
+}
+
+#endif
@@ -0,0 +1,147 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+/*
+ * Heap allocation check of the incremental history path.
+ *
+ * Synthetic uplinks, each received by a number of gateways, are replayed
+ * through AdrComponent::ReplayUplink for a set of registered devices: the
+ * reception updates the incremental history of the device, and the
+ * decision is taken on it. After a first round, which creates the state
+ * of the devices, no heap allocation must happen. Every combination of
+ * the TpAveraging and HistoryAveraging attributes is checked, and the
+ * program exits with a non-zero status if any of them allocates.
+ *
+ * Usage: adr-allocation-check --devices=1000 --history=20 --gateways=8
+ *                             --uplinks=100000
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/adr-component.h"
+#include "adr-allocation-counter.h"
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("AdrAllocationCheck");
+
+//Replay nUplinks random uplinks and return the heap allocations they made
+static uint64_t
+RunCheck (Ptr<AdrComponent> adr, uint32_t nDevices, uint32_t history,
+          uint32_t nGateways, uint32_t nUplinks)
+{
+  Ptr<UniformRandomVariable> rng = CreateObject<UniformRandomVariable> ();
+
+  std::vector<uint32_t> addresses;
+  std::vector<uint8_t> spreadingFactor;
+  std::vector<double> pathLoss;
+  for (uint32_t d = 0; d < nDevices; d++)
+    {
+      addresses.push_back (d);
+      spreadingFactor.push_back (rng->GetInteger (7, 12));
+      pathLoss.push_back (rng->GetValue (90, 140));
+    }
+  adr->RegisterDevices (addresses);
+
+  std::vector<double> rxPower (nGateways);
+
+  //Fill the histories, allocations are allowed here
+  for (uint32_t p = 0; p < history; p++)
+    {
+      for (uint32_t d = 0; d < nDevices; d++)
+        {
+          for (uint32_t g = 0; g < nGateways; g++)
+            {
+              rxPower[g] = 14 - pathLoss[d] - rng->GetValue (0, 20);
+            }
+          adr->ReplayUplink (d, p, spreadingFactor[d], 14, true, &rxPower[0], nGateways);
+        }
+    }
+
+  uint64_t allocations = 0;
+  for (uint32_t i = 0; i < nUplinks; i++)
+    {
+      uint32_t d = rng->GetInteger (0, nDevices - 1);
+      for (uint32_t g = 0; g < nGateways; g++)
+        {
+          rxPower[g] = 14 - pathLoss[d] - rng->GetValue (0, 20);
+        }
+
+      g_allocations = 0;
+      g_countAllocations = true;
+
+      adr->ReplayUplink (d, history + i, spreadingFactor[d], 14, true,
+                         &rxPower[0], nGateways);
+
+      g_countAllocations = false;
+      allocations += g_allocations;
+    }
+
+  return allocations;
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint32_t nDevices = 1000;
+  uint32_t history = 20;
+  uint32_t nGateways = 8;
+  uint32_t nUplinks = 100000;
+
+  CommandLine cmd;
+  cmd.AddValue ("devices", "Number of end devices", nDevices);
+  cmd.AddValue ("history", "HistoryRange of the component, and number of "
+                "uplinks sent by each device before the check", history);
+  cmd.AddValue ("gateways", "Number of gateways receiving each uplink", nGateways);
+  cmd.AddValue ("uplinks", "Number of uplinks to check", nUplinks);
+  cmd.Parse (argc, argv);
+
+  const char *tpPolicies[] = {"Max", "Average", "TopK", "Combined"};
+  const char *policies[] = {"Max", "Average", "Ewma"};
+
+  std::cout << std::setw (12) << "TpAvg" << std::setw (12) << "HistoryAvg"
+            << std::setw (14) << "allocations" << std::endl;
+
+  bool failed = false;
+  for (int tp = 0; tp < 4; tp++)
+    {
+      for (int h = 0; h < 3; h++)
+        {
+          Ptr<AdrComponent> adr = CreateObject<AdrComponent> ();
+          adr->SetAttribute ("IncrementalHistory", BooleanValue (true));
+          adr->SetAttribute ("TpAveraging", EnumValue (tp));
+          adr->SetAttribute ("HistoryAveraging", EnumValue (h));
+          adr->SetAttribute ("HistoryRange", UintegerValue (history));
+
+          uint64_t allocations = RunCheck (adr, nDevices, history, nGateways, nUplinks);
+          failed = failed || allocations != 0;
+
+          std::cout << std::setw (12) << tpPolicies[tp]
+                    << std::setw (12) << policies[h]
+                    << std::setw (14) << allocations
+                    << (allocations != 0 ? "  FAILED" : "") << std::endl;
+        }
+    }
+
+  return failed ? 1 : 0;
+}
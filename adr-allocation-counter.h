@@ -0,0 +1,66 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#ifndef ADR_ALLOCATION_COUNTER_H
+#define ADR_ALLOCATION_COUNTER_H
+
+#include <cstdlib>
+#include <new>
+#include <stdint.h>
+
+//Replacement of the global operator new counting the heap allocations of
+//a program, shared by the benchmark and the allocation check. It defines
+//the operators, so it must be included by only one file of the program.
+//
+//Allocations are only counted while g_countAllocations is set. The
+//operators are kept out of line, so that the compiler does not pair the
+//inlined free with new.
+static uint64_t g_allocations = 0;
+static bool g_countAllocations = false;
+
+__attribute__ ((noinline)) void *
+operator new (std::size_t size)
+{
+  if (g_countAllocations)
+    {
+      g_allocations++;
+    }
+
+  void *p = std::malloc (size ? size : 1);
+  if (!p)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+__attribute__ ((noinline)) void
+operator delete (void *p) noexcept
+{
+  std::free (p);
+}
+
+__attribute__ ((noinline)) void
+operator delete (void *p, std::size_t) noexcept
+{
+  std::free (p);
+}
+
+#endif
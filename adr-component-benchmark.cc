@@ -0,0 +1,302 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+/*
+ * Benchmark of the AdrComponent decision path.
+ *
+ * A set of synthetic end devices is filled with a history of uplinks, each
+ * received by a number of gateways, and BeforeSendingReply is then called
+ * twice for randomly chosen devices: the first call follows OnFailedReply,
+ * so that the decision is computed again, and the second one reuses the
+ * decision cached by the first. For every combination of the TpAveraging,
+ * HistoryAveraging and IncrementalHistory attributes the program reports
+ * the p50 and p99 latency (ns) of both, the heap allocations per computed
+ * decision and the throughput in computed decisions per second.
+ *
+ * The closed form step computation (AdrComponent::ApplyAdrSteps) is then
+ * timed on random inputs and on a fixed input: since it has no data
+ * dependent branches, both take the same time per call.
+ *
+ * Usage: adr-component-benchmark --devices=1000 --history=20 --gateways=8
+ *                                --decisions=100000
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/adr-component.h"
+#include "ns3/end-device-status.h"
+#include "ns3/end-device-lora-mac.h"
+#include "ns3/network-status.h"
+#include "ns3/lora-frame-header.h"
+#include "ns3/lora-mac-header.h"
+#include "ns3/lora-tag.h"
+#include "ns3/mac48-address.h"
+#include "adr-allocation-counter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("AdrComponentBenchmark");
+
+struct BenchmarkResult
+{
+  double missP50;     //Latency of a computed decision (ns)
+  double missP99;     //Latency of a computed decision (ns)
+  double hitP50;      //Latency of a cached decision (ns)
+  double hitP99;      //Latency of a cached decision (ns)
+  double allocations; //Heap allocations per computed decision
+  double throughput;  //Computed decisions per second
+};
+
+//Latency at quantile q of the given ones
+static double
+GetPercentile (std::vector<double> &latencies, double q)
+{
+  std::vector<double>::iterator it = latencies.begin () + size_t (q * (latencies.size () - 1));
+  std::nth_element (latencies.begin (), it, latencies.end ());
+  return *it;
+}
+
+//Create an uplink from the given device, requesting ADR
+static Ptr<Packet>
+CreateUplink (uint32_t address, uint16_t fCnt, uint8_t sf)
+{
+  Ptr<Packet> packet = Create<Packet> (10);
+
+  LoraFrameHeader fHdr;
+  fHdr.SetAsUplink ();
+  fHdr.SetAddress (LoraDeviceAddress (address));
+  fHdr.SetAdr (true);
+  fHdr.SetFCnt (fCnt);
+  packet->AddHeader (fHdr);
+
+  LoraMacHeader mHdr;
+  mHdr.SetMType (LoraMacHeader::UNCONFIRMED_DATA_UP);
+  packet->AddHeader (mHdr);
+
+  LoraTag tag;
+  tag.SetSpreadingFactor (sf);
+  packet->AddPacketTag (tag);
+
+  return packet;
+}
+
+static BenchmarkResult
+RunBenchmark (Ptr<AdrComponent> adr, uint32_t nDevices, uint32_t history,
+              uint32_t nGateways, uint32_t nDecisions)
+{
+  Ptr<UniformRandomVariable> rng = CreateObject<UniformRandomVariable> ();
+  Ptr<NetworkStatus> networkStatus = CreateObject<NetworkStatus> ();
+
+  std::vector<Address> gateways;
+  for (uint32_t g = 0; g < nGateways; g++)
+    {
+      gateways.push_back (Mac48Address::Allocate ());
+    }
+
+  //Fill the history of every device, reporting each packet to the
+  //component once per gateway, as the network server does
+  std::vector<Ptr<EndDeviceStatus> > devices;
+  for (uint32_t d = 0; d < nDevices; d++)
+    {
+      Ptr<EndDeviceLoraMac> mac = CreateObject<EndDeviceLoraMac> ();
+      mac->SetDeviceAddress (LoraDeviceAddress (d));
+      Ptr<EndDeviceStatus> status =
+        CreateObject<EndDeviceStatus> (LoraDeviceAddress (d), mac);
+
+      uint8_t sf = rng->GetInteger (7, 12);
+      double pathLoss = rng->GetValue (90, 140);
+      for (uint32_t p = 0; p < history; p++)
+        {
+          Ptr<Packet> packet = CreateUplink (d, p, sf);
+          for (uint32_t g = 0; g < nGateways; g++)
+            {
+              Ptr<Packet> copy = packet->Copy ();
+              LoraTag tag;
+              copy->RemovePacketTag (tag);
+              tag.SetReceivePower (14 - pathLoss - rng->GetValue (0, 20));
+              copy->AddPacketTag (tag);
+
+              status->InsertReceivedPacket (copy, gateways[g]);
+              adr->OnReceivedPacket (copy, status, networkStatus);
+            }
+        }
+      devices.push_back (status);
+    }
+
+  std::vector<double> missLatencies (nDecisions);
+  std::vector<double> hitLatencies (nDecisions);
+  uint64_t allocations = 0;
+  double total = 0;
+
+  for (uint32_t i = 0; i < nDecisions; i++)
+    {
+      Ptr<EndDeviceStatus> status = devices[rng->GetInteger (0, nDevices - 1)];
+
+      //Drop the cached decision, so that the first call computes it
+      adr->OnFailedReply (status, networkStatus);
+      status->InitializeReply ();
+
+      g_allocations = 0;
+      g_countAllocations = true;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+      adr->BeforeSendingReply (status, networkStatus);
+
+      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now ();
+      g_countAllocations = false;
+      allocations += g_allocations;
+
+      missLatencies[i] = std::chrono::duration<double, std::nano> (end - start).count ();
+      total += missLatencies[i];
+
+      //Nothing changed since: the second call reuses the decision
+      status->InitializeReply ();
+
+      start = std::chrono::steady_clock::now ();
+      adr->BeforeSendingReply (status, networkStatus);
+      end = std::chrono::steady_clock::now ();
+
+      hitLatencies[i] = std::chrono::duration<double, std::nano> (end - start).count ();
+    }
+
+  BenchmarkResult result;
+  result.missP50 = GetPercentile (missLatencies, 0.5);
+  result.missP99 = GetPercentile (missLatencies, 0.99);
+  result.hitP50 = GetPercentile (hitLatencies, 0.5);
+  result.hitP99 = GetPercentile (hitLatencies, 0.99);
+  result.allocations = double (allocations) / nDecisions;
+  result.throughput = nDecisions / (total * 1e-9);
+
+  return result;
+}
+
+//Time per call (ns) of ApplyAdrSteps over the given inputs
+static double
+RunStepBenchmark (const std::vector<int> &steps, const std::vector<uint8_t> &sf,
+                  const std::vector<double> &tp)
+{
+  uint64_t checksum = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+  for (size_t i = 0; i < steps.size (); i++)
+    {
+      uint8_t newSf = sf[i];
+      double newTp = tp[i];
+      AdrComponent::ApplyAdrSteps (steps[i], 7, 2, 14, &newSf, &newTp);
+      checksum += newSf + uint64_t (newTp);
+    }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now ();
+
+  //Keep the results alive
+  volatile uint64_t sink = checksum;
+  (void) sink;
+
+  return std::chrono::duration<double, std::nano> (end - start).count () / steps.size ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint32_t nDevices = 1000;
+  uint32_t history = 20;
+  uint32_t nGateways = 8;
+  uint32_t nDecisions = 100000;
+
+  CommandLine cmd;
+  cmd.AddValue ("devices", "Number of end devices", nDevices);
+  cmd.AddValue ("history", "HistoryRange of the component, and number of "
+                "uplinks sent by each device", history);
+  cmd.AddValue ("gateways", "Number of gateways receiving each uplink", nGateways);
+  cmd.AddValue ("decisions", "Number of decisions to time", nDecisions);
+  cmd.Parse (argc, argv);
+
+  const char *tpPolicies[] = {"Max", "Average", "TopK", "Combined"};
+  const char *policies[] = {"Max", "Average", "Ewma"};
+
+  std::cout << "devices=" << nDevices << " history=" << history
+            << " gateways=" << nGateways << " decisions=" << nDecisions
+            << std::endl;
+  std::cout << std::setw (12) << "Incremental" << std::setw (12) << "TpAvg"
+            << std::setw (12) << "HistoryAvg" << std::setw (12) << "miss p50"
+            << std::setw (12) << "miss p99" << std::setw (12) << "hit p50"
+            << std::setw (12) << "hit p99" << std::setw (12) << "allocs"
+            << std::setw (14) << "decisions/s" << std::endl;
+
+  for (int incremental = 1; incremental >= 0; incremental--)
+    {
+      for (int tp = 0; tp < 4; tp++)
+        {
+          for (int h = 0; h < 3; h++)
+            {
+              Ptr<AdrComponent> adr = CreateObject<AdrComponent> ();
+              adr->SetAttribute ("IncrementalHistory", BooleanValue (incremental));
+              adr->SetAttribute ("TpAveraging", EnumValue (tp));
+              adr->SetAttribute ("HistoryAveraging", EnumValue (h));
+              adr->SetAttribute ("HistoryRange", UintegerValue (history));
+
+              BenchmarkResult result = RunBenchmark (adr, nDevices, history,
+                                                     nGateways, nDecisions);
+
+              std::cout << std::setw (12) << (incremental ? "yes" : "no")
+                        << std::setw (12) << tpPolicies[tp]
+                        << std::setw (12) << policies[h]
+                        << std::fixed << std::setprecision (1)
+                        << std::setw (12) << result.missP50
+                        << std::setw (12) << result.missP99
+                        << std::setw (12) << result.hitP50
+                        << std::setw (12) << result.hitP99
+                        << std::setprecision (2)
+                        << std::setw (12) << result.allocations
+                        << std::setprecision (0)
+                        << std::setw (14) << result.throughput << std::endl;
+            }
+        }
+    }
+
+  //Steps over the whole range, and settings anywhere within the limits
+  Ptr<UniformRandomVariable> rng = CreateObject<UniformRandomVariable> ();
+  std::vector<int> steps (nDecisions);
+  std::vector<uint8_t> sf (nDecisions);
+  std::vector<double> tp (nDecisions);
+  for (uint32_t i = 0; i < nDecisions; i++)
+    {
+      steps[i] = rng->GetInteger (0, 16) - 8;
+      sf[i] = rng->GetInteger (7, 12);
+      tp[i] = 2 * rng->GetInteger (1, 7);
+    }
+
+  double randomTime = RunStepBenchmark (steps, sf, tp);
+
+  std::fill (steps.begin (), steps.end (), 2);
+  std::fill (sf.begin (), sf.end (), 10);
+  std::fill (tp.begin (), tp.end (), 14);
+  double fixedTime = RunStepBenchmark (steps, sf, tp);
+
+  std::cout << std::endl << "ApplyAdrSteps: " << std::setprecision (2)
+            << randomTime << " ns/call on random inputs, "
+            << fixedTime << " ns/call on a fixed input" << std::endl;
+
+  return 0;
+}
@@ -19,9 +19,200 @@
  */
 
 #include "ns3/adr-component.h"
+#include "ns3/adr-reduction.h"
+#include "ns3/adr-snr-tag.h"
+#include "ns3/lora-tag.h"
+#include "ns3/simulator.h"
+#include "ns3/trace-source-accessor.h"
+#include "ns3/boolean.h"
+#include "ns3/double.h"
+#include "ns3/enum.h"
+#include "ns3/integer.h"
+#include "ns3/nstime.h"
+#include "ns3/uinteger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace ns3 {
 
+  /////////////////////////////////////
+  // Per-device received SNR history //
+  /////////////////////////////////////
+
+  SnrHistory::SnrHistory (uint8_t capacity, char *storage) :
+    m_samples (reinterpret_cast<double *> (storage)),
+    m_maxSeq (reinterpret_cast<uint64_t *> (storage + capacity * sizeof (double))),
+    m_maxValue (reinterpret_cast<double *> (storage + capacity * (sizeof (double) + sizeof (uint64_t)))),
+    m_capacity (capacity),
+    m_count (0),
+    m_sum (0),
+    m_maxHead (0),
+    m_maxSize (0)
+  {
+    NS_ASSERT (capacity > 0);
+  }
+
+  size_t SnrHistory::GetStorageSize (uint8_t capacity)
+  {
+    return capacity * (2 * sizeof (double) + sizeof (uint64_t));
+  }
+
+  void SnrHistory::Clear (void)
+  {
+    m_count = 0;
+    m_sum = 0;
+    m_maxHead = 0;
+    m_maxSize = 0;
+  }
+
+  void SnrHistory::Push (double snr)
+  {
+    if(m_count > 0)
+    {
+      //Sequence number of the oldest sample in the window after this push
+      uint64_t oldest = m_count + 1 > m_capacity ? m_count + 1 - m_capacity : 0;
+
+      //Drop the sealed samples that are going out of the window
+      while(m_maxSize > 0 && m_maxSeq[m_maxHead] < oldest)
+      {
+        m_maxHead = (m_maxHead + 1) % m_capacity;
+        m_maxSize--;
+      }
+
+      //Seal the current newest sample, removing from the back of the
+      //queue all the samples it dominates
+      uint64_t newestSeq = m_count - 1;
+      if(newestSeq >= oldest)
+      {
+        double newest = m_samples[newestSeq % m_capacity];
+        while(m_maxSize > 0 &&
+              m_maxValue[(m_maxHead + m_maxSize - 1) % m_capacity] <= newest)
+          m_maxSize--;
+
+        uint8_t back = (m_maxHead + m_maxSize) % m_capacity;
+        m_maxSeq[back] = newestSeq;
+        m_maxValue[back] = newest;
+        m_maxSize++;
+      }
+    }
+
+    uint8_t index = m_count % m_capacity;
+    if(m_count >= m_capacity)
+      m_sum -= m_samples[index];
+    m_samples[index] = snr;
+    m_sum += snr;
+    m_count++;
+
+    //Recompute the sum once per turn of the ring, so that rounding errors
+    //of the running sum do not build up over long runs
+    if(m_count % m_capacity == 0)
+    {
+      m_sum = AdrReduceSum (&m_samples[0], m_capacity);
+    }
+  }
+
+  void SnrHistory::Prefetch (void) const
+  {
+    //Slot written by the next Push, and ends of the max queue
+    uint8_t back = (m_maxHead + m_maxSize) % m_capacity;
+    __builtin_prefetch (&m_samples[m_count % m_capacity], 1);
+    __builtin_prefetch (&m_maxSeq[m_maxHead], 1);
+    __builtin_prefetch (&m_maxSeq[back], 1);
+    __builtin_prefetch (&m_maxValue[back], 1);
+  }
+
+  void SnrHistory::UpdateNewest (double snr)
+  {
+    NS_ASSERT (m_count > 0);
+
+    uint8_t index = (m_count - 1) % m_capacity;
+    m_sum += snr - m_samples[index];
+    m_samples[index] = snr;
+  }
+
+  uint8_t SnrHistory::GetSize (void) const
+  {
+    return m_count < m_capacity ? m_count : m_capacity;
+  }
+
+  void SnrHistory::GetSamples (double *snr) const
+  {
+    uint8_t size = GetSize ();
+    for(uint8_t i = 0; i < size; i++)
+      snr[i] = m_samples[(m_count - size + i) % m_capacity];
+  }
+
+  double SnrHistory::GetAverage (void) const
+  {
+    return m_sum / GetSize ();
+  }
+
+  double SnrHistory::GetMax (void) const
+  {
+    double max = m_samples[(m_count - 1) % m_capacity];
+
+    if(m_maxSize > 0 && m_maxValue[m_maxHead] > max)
+      max = m_maxValue[m_maxHead];
+
+    return max;
+  }
+
+  SnrEwma::SnrEwma () :
+    m_previous (0),
+    m_estimate (0),
+    m_count (0)
+  {}
+
+  void SnrEwma::Push (double snr, double weight)
+  {
+    m_previous = m_estimate;
+    m_count++;
+    UpdateNewest (snr, weight);
+  }
+
+  void SnrEwma::UpdateNewest (double snr, double weight)
+  {
+    NS_ASSERT (m_count > 0);
+
+    //The first packet initializes the estimate
+    if(m_count == 1)
+      m_estimate = snr;
+    else
+      m_estimate = (1 - weight) * m_previous + weight * snr;
+  }
+
+  uint64_t SnrEwma::GetCount (void) const
+  {
+    return m_count;
+  }
+
+  double SnrEwma::GetEstimate (void) const
+  {
+    return m_estimate;
+  }
+
+  double SnrEwma::GetPrevious (void) const
+  {
+    return m_previous;
+  }
+
+  void SnrEwma::Restore (double previous, double estimate, uint64_t count)
+  {
+    m_previous = previous;
+    m_estimate = estimate;
+    m_count = count;
+  }
+
   ////////////////////////////////////////
   // LinkAdrRequest commands management //
   ////////////////////////////////////////
@@ -30,26 +221,298 @@ namespace ns3 {
 
   NS_OBJECT_ENSURE_REGISTERED (AdrComponent);
 
+  constexpr double AdrComponent::treshold[6];
+  constexpr double AdrComponent::airtime[6];
+  constexpr double AdrComponent::minMargin;
+  constexpr double AdrComponent::marginBucketWidth;
+
   TypeId AdrComponent::GetTypeId (void)
   {
     static TypeId tid = TypeId ("ns3::AdrComponent")
     .SetGroupName ("lorawan")
-    .AddConstructor<AdrComponent> ();
+    .AddConstructor<AdrComponent> ()
+    .AddAttribute ("TpAveraging",
+                   "Policy used to combine the power received by the gateways",
+                   EnumValue (AdrComponent::AVERAGE_TX_POWER),
+                   MakeEnumAccessor (&AdrComponent::SetTpAveraging,
+                                     &AdrComponent::GetTpAveraging),
+                   MakeEnumChecker (AdrComponent::MAX_TX_POWER, "Max",
+                                    AdrComponent::AVERAGE_TX_POWER, "Average",
+                                    AdrComponent::TOP_K_TX_POWER, "TopK",
+                                    AdrComponent::COMBINED_TX_POWER, "Combined"))
+    .AddAttribute ("TopKGateways",
+                   "Number of strongest gateways averaged by the TopK policy",
+                   UintegerValue (3),
+                   MakeUintegerAccessor (&AdrComponent::SetTopKGateways,
+                                         &AdrComponent::GetTopKGateways),
+                   MakeUintegerChecker<uint8_t> (1, AdrComponent::maxTopKGateways))
+    .AddAttribute ("HistoryRange",
+                   "Number of previous packets to consider",
+                   UintegerValue (20),
+                   MakeUintegerAccessor (&AdrComponent::SetHistoryRange,
+                                         &AdrComponent::GetHistoryRange),
+                   MakeUintegerChecker<uint8_t> (1))
+    .AddAttribute ("HistoryAveraging",
+                   "Policy used to combine the SNR of the previous packets",
+                   EnumValue (AdrComponent::AVERAGE_SNR),
+                   MakeEnumAccessor (&AdrComponent::SetHistoryAveraging,
+                                     &AdrComponent::GetHistoryAveraging),
+                   MakeEnumChecker (AdrComponent::MAX_SNR, "Max",
+                                    AdrComponent::AVERAGE_SNR, "Average",
+                                    AdrComponent::EWMA_SNR, "Ewma"))
+    .AddAttribute ("EwmaWeight",
+                   "Weight of the newest packet in the Ewma history policy",
+                   DoubleValue (0.1),
+                   MakeDoubleAccessor (&AdrComponent::SetEwmaWeight,
+                                       &AdrComponent::GetEwmaWeight),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("IncrementalHistory",
+                   "Whether to keep the SNR history of each device updated on "
+                   "reception, instead of scanning its received packets at "
+                   "every decision",
+                   BooleanValue (true),
+                   MakeBooleanAccessor (&AdrComponent::SetIncrementalHistory,
+                                        &AdrComponent::GetIncrementalHistory),
+                   MakeBooleanChecker ())
+    .AddAttribute ("Region",
+                   "Regional parameters profile",
+                   EnumValue (AdrComponent::EU868),
+                   MakeEnumAccessor (&AdrComponent::SetRegion,
+                                     &AdrComponent::GetRegion),
+                   MakeEnumChecker (AdrComponent::EU868, "EU868",
+                                    AdrComponent::US915, "US915",
+                                    AdrComponent::AS923, "AS923"))
+    .AddAttribute ("MinSpreadingFactor",
+                   "SF lower limit",
+                   IntegerValue (7),
+                   MakeIntegerAccessor (&AdrComponent::SetMinSpreadingFactor,
+                                        &AdrComponent::GetMinSpreadingFactor),
+                   MakeIntegerChecker<int> (7, 12))
+    .AddAttribute ("MinTransmissionPower",
+                   "Minimum transmission power (dBm), raised to the one of "
+                   "the region if lower",
+                   IntegerValue (2),
+                   MakeIntegerAccessor (&AdrComponent::SetMinTransmissionPower,
+                                        &AdrComponent::GetMinTransmissionPower),
+                   MakeIntegerChecker<int> ())
+    .AddAttribute ("MaxTransmissionPower",
+                   "Maximum transmission power (dBm), lowered to the one of "
+                   "the region if higher",
+                   IntegerValue (14),
+                   MakeIntegerAccessor (&AdrComponent::SetMaxTransmissionPower,
+                                        &AdrComponent::GetMaxTransmissionPower),
+                   MakeIntegerChecker<int> ())
+    .AddAttribute ("Offset",
+                   "Device specific SNR margin (dB)",
+                   IntegerValue (10),
+                   MakeIntegerAccessor (&AdrComponent::SetOffset,
+                                        &AdrComponent::GetOffset),
+                   MakeIntegerChecker<int> ())
+    .AddAttribute ("WarmUpSamples",
+                   "Number of packets after which the first decisions of a "
+                   "device are taken, with an extra margin decreasing as the "
+                   "history fills up (0 to wait for HistoryRange packets)",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&AdrComponent::SetWarmUpSamples,
+                                         &AdrComponent::GetWarmUpSamples),
+                   MakeUintegerChecker<uint8_t> ())
+    .AddAttribute ("WarmUpMargin",
+                   "Extra SNR margin (dB) of a decision taken on WarmUpSamples "
+                   "packets",
+                   DoubleValue (5),
+                   MakeDoubleAccessor (&AdrComponent::SetWarmUpMargin,
+                                       &AdrComponent::GetWarmUpMargin),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("AirtimeAware",
+                   "Whether to choose, among the data rates allowed by the "
+                   "link margin, the one minimizing the expected airtime per "
+                   "delivered frame given the load of the network",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&AdrComponent::SetAirtimeAware,
+                                        &AdrComponent::GetAirtimeAware),
+                   MakeBooleanChecker ())
+    .AddAttribute ("LoadWindow",
+                   "Time constant of the network load measured by the "
+                   "AirtimeAware mode",
+                   TimeValue (Minutes (30)),
+                   MakeTimeAccessor (&AdrComponent::SetLoadWindow,
+                                     &AdrComponent::GetLoadWindow),
+                   MakeTimeChecker ())
+    .AddAttribute ("Hysteresis",
+                   "Extra SNR margin (dB) required to change the settings of "
+                   "a device, to avoid commands going back and forth around "
+                   "a step boundary",
+                   DoubleValue (0),
+                   MakeDoubleAccessor (&AdrComponent::SetHysteresis,
+                                       &AdrComponent::GetHysteresis),
+                   MakeDoubleChecker<double> (0))
+    .AddAttribute ("MinCommandInterval",
+                   "Minimum time between two LinkAdrReq sent to a device",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&AdrComponent::SetMinCommandInterval,
+                                     &AdrComponent::GetMinCommandInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("DownlinkBudget",
+                   "Number of LinkAdrReq each gateway can send per "
+                   "BudgetWindow, ranked by airtime saved when scarce (0 for "
+                   "no limit)",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&AdrComponent::SetDownlinkBudget,
+                                         &AdrComponent::GetDownlinkBudget),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("BudgetWindow",
+                   "Window of the DownlinkBudget",
+                   TimeValue (Hours (1)),
+                   MakeTimeAccessor (&AdrComponent::SetBudgetWindow,
+                                     &AdrComponent::GetBudgetWindow),
+                   MakeTimeChecker ())
+    .AddAttribute ("MaxRepetitions",
+                   "Upper limit of the NbTrans setting of the devices, "
+                   "chosen from the frame loss measured on the gaps between "
+                   "their frame counters (1 to never repeat frames)",
+                   UintegerValue (1),
+                   MakeUintegerAccessor (&AdrComponent::SetMaxRepetitions,
+                                         &AdrComponent::GetMaxRepetitions),
+                   MakeUintegerChecker<uint8_t> (1, 15))
+    .AddAttribute ("TargetFrameLoss",
+                   "Frame loss the NbTrans setting aims for",
+                   DoubleValue (0.01),
+                   MakeDoubleAccessor (&AdrComponent::SetTargetFrameLoss,
+                                       &AdrComponent::GetTargetFrameLoss),
+                   MakeDoubleChecker<double> (0, 1))
+    .AddAttribute ("PrecomputeInterval",
+                   "Period of the job computing the decisions of all the "
+                   "devices ahead of their replies, which then only look "
+                   "them up (0 to decide when replying). Requires the "
+                   "incremental history.",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&AdrComponent::SetPrecomputeInterval,
+                                     &AdrComponent::GetPrecomputeInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("SnrSource",
+                   "Source of the SNR of each reception: derived from the "
+                   "received power, or measured by the gateway and carried "
+                   "by an AdrSnrTag. Measured always uses the incremental "
+                   "history, and receptions without the tag fall back to "
+                   "the derived SNR.",
+                   EnumValue (AdrComponent::DERIVED_SNR),
+                   MakeEnumAccessor (&AdrComponent::SetSnrSource,
+                                     &AdrComponent::GetSnrSource),
+                   MakeEnumChecker (AdrComponent::DERIVED_SNR, "Derived",
+                                    AdrComponent::MEASURED_SNR, "Measured"))
+    .AddTraceSource ("AdrDecision",
+                     "Trace source fired for every ADR decision, with the "
+                     "old and new settings of the device",
+                     MakeTraceSourceAccessor (&AdrComponent::m_decisionTrace),
+                     "ns3::AdrComponent::DecisionTracedCallback");
     return tid;
   }
 
-  AdrComponent::AdrComponent () {}
+  AdrComponent::AdrComponent () :
+    m_counters (counterSlots)
+  {
+    ResetStatistics ();
+    SelectPolicies ();
+  }
 
   AdrComponent::~AdrComponent () {}
 
+  void AdrComponent::DoDispose (void)
+  {
+    Simulator::Cancel (m_precomputeEvent);
+
+    for(std::unordered_map<uint64_t, PendingRequest>::iterator it = m_pendingRequests.begin ();
+        it != m_pendingRequests.end (); it++)
+      Simulator::Cancel (it->second.deadline);
+    m_pendingRequests.clear ();
+    m_historyFetch = HistoryFetchCallback ();
+
+    NetworkControllerComponent::DoDispose ();
+  }
+
+  AdrComponent::DeviceState::DeviceState (uint32_t address,
+                                          const SnrHistory &history) :
+    lastPacketUid (std::numeric_limits<uint64_t>::max ()),
+    historyEpoch (0),
+    deviceAddress (address),
+    adrRequested (false),
+    spreadingFactor (0),
+    transmissionPower (0),
+    snrHistory (history),
+    lastCommandTime (-std::numeric_limits<double>::infinity ()),
+    gwCount (0),
+    snrSum (0),
+    snrMax (0),
+    snrCombined (0),
+    topCount (0),
+    lastFCnt (0),
+    fCntValid (false),
+    frameLoss (0),
+    nbTrans (1),
+    commandPending (false),
+    previousNbTrans (1),
+    previousCommandTime (-std::numeric_limits<double>::infinity ()),
+    commandBudget (0),
+    commandGainChange (0),
+    commandBudgetEpoch (0)
+  {
+    snrHistory.Clear ();
+    InvalidateCachedDecision ();
+  }
+
+  void AdrComponent::DeviceState::InvalidateCachedDecision (void)
+  {
+    //historyEpoch never reaches this value
+    cachedDecision.historyEpoch = std::numeric_limits<uint64_t>::max ();
+  }
+
   void AdrComponent::OnReceivedPacket (Ptr<const Packet> packet,
                                        Ptr<EndDeviceStatus> status,
                                        Ptr<NetworkStatus> networkStatus)
   {
     NS_LOG_FUNCTION (this->GetTypeId() << packet << networkStatus);
 
-    // We will only act just before reply, when all Gateways will have received
-    // the packet, since we need their respective received power.
+    //This method is called once for every gateway that received the packet
+    DeviceState &state =
+      GetDeviceState (status->GetMac ()->GetDeviceAddress ().Get ());
+
+    bool newPacket = packet->GetUid () != state.lastPacketUid;
+    state.historyEpoch++;
+
+    LoraTag tag;
+    packet->PeekPacketTag (tag);
+
+    //Parse the headers and read the device settings only the first time
+    //the packet is seen, so that the reply path can just read them from
+    //the state
+    if(newPacket)
+    {
+      LoraFrameHeader fHdr = GetFrameHeader (packet);
+
+      state.lastPacketUid = packet->GetUid ();
+      state.commandPending = false;
+      state.adrRequested = fHdr.GetAdr ();
+      UpdateFrameLoss (state, fHdr.GetFCnt ());
+      state.spreadingFactor = tag.GetSpreadingFactor ();
+      state.transmissionPower = status->GetMac ()->GetTransmissionPower ();
+
+      if(airtimeAware)
+        UpdateLoad (tag.GetSpreadingFactor (), tag.GetFrequency ());
+    }
+
+    // Without incremental history we will only act just before reply, when
+    // all Gateways will have received the packet, since we need their
+    // respective received power.
+    if(!m_useIncrementalHistory)
+      return;
+
+    //Convert the reception to SNR once, here, so that the decisions only
+    //combine SNR values. The measured one also accounts for interference.
+    AdrSnrTag snrTag;
+    if(snrSource == MEASURED_SNR && packet->PeekPacketTag (snrTag))
+      AddReception (state, newPacket, snrTag.GetSnr ());
+    else
+      AddReception (state, newPacket, TxPowerToSNR (tag.GetReceivePower ()));
   }
 
   void
@@ -58,61 +521,112 @@ namespace ns3 {
   {
     NS_LOG_FUNCTION (this << status << networkStatus);
 
-    Ptr<Packet> myPacket = status->GetLastPacketReceivedFromDevice ()->Copy();
-    LoraMacHeader mHdr;
-    LoraFrameHeader fHdr;
-    fHdr.SetAsUplink ();
-    myPacket->RemoveHeader(mHdr);
-    myPacket->RemoveHeader(fHdr);
+    DeviceState *deviceState = FindDeviceState (status);
+    DeviceState *state = deviceState;
+    Ptr<const Packet> lastPacket = status->GetLastPacketReceivedFromDevice ();
+
+    //Use the ADR bit and settings cached on reception when available,
+    //parse the headers of the packet and query the device otherwise
+    if(state && state->lastPacketUid != lastPacket->GetUid ())
+      state = 0;
+
+    bool adrRequested = state ? state->adrRequested : GetAdrBit (lastPacket);
 
     //Execute the ADR algotithm only if the request bit is set
-    if(fHdr.GetAdr())
+    if(adrRequested)
     {
-      if(status->GetReceivedPacketList().size() < historyRange)
+      size_t historySize = GetHistorySize (status, state);
+      if(historySize < GetRequiredHistorySize ())
+      {
         NS_LOG_DEBUG ("Not enough packets received by this device for the algorithm to work");
+        GetCounters ().insufficientHistory.fetch_add (1, std::memory_order_relaxed);
+      }
       else
       {
-        //The device request an ADR tuning, so it is going to require answering
-        status->m_reply.needsReply = true;
-        
         //Get the SF used by the device
-        uint8_t spreadingFactor = status->GetFirstReceiveWindowSpreadingFactor();
+        uint8_t spreadingFactor = state ? state->spreadingFactor :
+          status->GetFirstReceiveWindowSpreadingFactor();
 
         //Get the device transmission power (dBm)
-        uint8_t transmissionPower = status->GetMac()->GetTransmissionPower();
+        uint8_t transmissionPower = state ? state->transmissionPower :
+          status->GetMac()->GetTransmissionPower();
 
         //New parameters for the end-device
         uint8_t newDataRate;
         uint8_t newTxPower;
+        double margin;
 
         //ADR Algorithm
         AdrImplementation(&newDataRate,
                           &newTxPower,
-                          status);
+                          &margin,
+                          spreadingFactor,
+                          transmissionPower,
+                          historySize,
+                          status,
+                          state);
 
-        if(newDataRate != SfToDr(spreadingFactor) || newTxPower != transmissionPower)
-        {
-          //Create a list with mandatory channel indexes
-          int channels[] = {1, 2, 3};
-          std::list<int> enabledChannels(channels,
-                                         channels + sizeof(channels) /
-                                         sizeof(int));
+        DecisionTrace decision;
+        decision.time = Simulator::Now ().GetNanoSeconds ();
+        decision.margin = margin;
+        decision.deviceAddress = state ? state->deviceAddress :
+          status->GetMac ()->GetDeviceAddress ().Get ();
+        decision.oldDataRate = SfToDr(spreadingFactor);
+        decision.newDataRate = newDataRate;
+        decision.oldTxPower = transmissionPower;
+        decision.newTxPower = newTxPower;
+        m_decisionTrace (decision);
+
+        //Repetitions Setting
+        uint8_t rep = deviceState ? GetRepetitions (*deviceState) : 1;
+
+        bool changed = newDataRate != SfToDr(spreadingFactor) ||
+          newTxPower != transmissionPower ||
+          (deviceState && rep != deviceState->nbTrans);
+        RecordDecision (margin, changed);
+
+        double now = Simulator::Now ().GetSeconds ();
+        bool rateLimited = changed && deviceState &&
+          now - deviceState->lastCommandTime < minCommandInterval;
 
-          //Repetitions Setting
-          const int rep = 1;
+        if(rateLimited)
+        {
+          NS_LOG_DEBUG ("LinkAdrReq sent less than MinCommandInterval ago, skipped request");
+          GetCounters ().rateLimited.fetch_add (1, std::memory_order_relaxed);
+        }
+        else if(changed &&
+                !AdmitCommand (networkStatus, status->GetMac ()->GetDeviceAddress (),
+                               GetAirtimeGain (spreadingFactor, newDataRate),
+                               newDataRate < SfToDr(spreadingFactor) ||
+                               newTxPower > transmissionPower,
+                               deviceState))
+        {
+          //The decision stays cached, the command is sent on a later reply
+          NS_LOG_DEBUG ("Downlink budget of the gateway exhausted, deferred request");
+          GetCounters ().budgetLimited.fetch_add (1, std::memory_order_relaxed);
+        }
+        else if(changed)
+        {
+          //Only answer the device if there is a command for it: a reply
+          //without it would just take airtime of the receive windows
+          status->m_reply.needsReply = true;
 
-          NS_LOG_ERROR ("Sending LinkAdrReq with DR = "<<(unsigned)newDataRate<<" and TP = "<<(unsigned)newTxPower<<" dBm");
+          NS_LOG_DEBUG ("Sending LinkAdrReq with DR = "<<(unsigned)newDataRate<<", TP = "<<(unsigned)newTxPower<<" dBm and NbTrans = "<<(unsigned)rep);
 
           status->m_reply.frameHeader.AddLinkAdrReq(newDataRate,
-                                                    GetTxPowerIndex(newTxPower),
-                                                    enabledChannels,
+                                                    GetTxPowerIndex(*m_region, newTxPower),
+                                                    m_enabledChannels,
                                                     rep);
           status->m_reply.frameHeader.SetAsDownlink();
           status->m_reply.macHeader.SetMType(LoraMacHeader::UNCONFIRMED_DATA_DOWN);
+          GetCounters ().linkAdrReqs.fetch_add (1, std::memory_order_relaxed);
+
+          if(deviceState)
+            RecordCommand (*deviceState, now, rep);
         }
         else
         {
-          NS_LOG_ERROR("Skipped request");
+          NS_LOG_DEBUG("Skipped request");
         }
       }
     }
@@ -126,189 +640,1614 @@ namespace ns3 {
                                     Ptr<NetworkStatus> networkStatus)
   {
     NS_LOG_FUNCTION (this->GetTypeId() << networkStatus);
+
+    //The device did not get the reply: evaluate the next attempt from
+    //scratch rather than reusing the decision carried by this one
+    DeviceState *state = FindDeviceState (status);
+    if(!state)
+      return;
+
+    state->InvalidateCachedDecision ();
+
+    //The command did not reach the device: it neither limits the next
+    //one nor changed its NbTrans
+    if(state->commandPending)
+    {
+      state->lastCommandTime = state->previousCommandTime;
+      state->nbTrans = state->previousNbTrans;
+      state->commandPending = false;
+
+      //Nor did it use the downlink budget of the gateway
+      if(state->commandBudget && state->commandBudgetEpoch == m_budgetEpoch)
+      {
+        GatewayBudget &budget = *state->commandBudget;
+        budget.tokens = std::min<double> (downlinkBudget, budget.tokens + 1);
+        budget.averageGain -= state->commandGainChange;
+      }
+      state->commandBudget = 0;
+    }
   }
 
-  void AdrComponent::AdrImplementation(uint8_t *newDataRate,
-                         uint8_t *newTxPower,
-                         Ptr<EndDeviceStatus> status)
+  std::vector<AdrComponent::AdrDecision>
+  AdrComponent::EvaluateBatch (const std::vector<Ptr<EndDeviceStatus> > &devices)
   {
-    //Compute the maximum or median SNR, based on the boolean value historyAveraging
-    double m_SNR;
-    if(historyAveraging)
-      m_SNR = GetAverageSNR(status->GetReceivedPacketList(),
-                            historyRange);
-    else
-      m_SNR = GetMaxSNR(status->GetReceivedPacketList(),
-                        historyRange);
+    NS_LOG_FUNCTION (this << devices.size ());
 
-    //Get the SF used by the device
-    uint8_t spreadingFactor = status->GetFirstReceiveWindowSpreadingFactor();
+    size_t n = devices.size ();
+    std::vector<AdrDecision> decisions (n);
+    if(n == 0)
+      return decisions;
 
-    //Get the device data rate and use it to get the SNR demodulation treshold
-    double req_SNR = treshold[SfToDr(spreadingFactor)];
+    //Gather the inputs of the algorithm in a structure-of-arrays layout
+    std::vector<double> snr (n);
+    std::vector<double> requiredSnr (n);
+    std::vector<uint8_t> spreadingFactor (n);
+    std::vector<double> transmissionPower (n);
 
-    //Get the device transmission power (dBm)
-    double transmissionPower = status->GetMac()->GetTransmissionPower();
+    for(size_t i = 0; i < n; i++)
+    {
+      Ptr<EndDeviceStatus> status = devices[i];
+      const DeviceState *state = FindDeviceState (status);
 
-    //Compute the SNR margin taking into consideration the SNR of
-    //previously received packets
-    double margin_SNR = m_SNR - req_SNR - offset;
+      spreadingFactor[i] = state ? state->spreadingFactor :
+        status->GetFirstReceiveWindowSpreadingFactor();
+      transmissionPower[i] = state ? state->transmissionPower :
+        status->GetMac()->GetTransmissionPower();
+      size_t historySize = GetHistorySize (status, state);
+      decisions[i].valid = historySize >= GetRequiredHistorySize ();
+      snr[i] = decisions[i].valid ?
+        GetHistorySNR (status, state) - GetHistoryWarmUpMargin (historySize) : 0;
+      requiredSnr[i] = treshold[SfToIndex(spreadingFactor[i])];
+    }
 
-    //Number of steps to decrement the SF (thereby increasing the Data Rate)
-    //and the TP.
-    int steps = std::floor(margin_SNR / 3);
+    std::vector<uint8_t> newSpreadingFactor (n);
+    std::vector<double> newTransmissionPower (n);
+    ComputeAdrSettingsBatch(n,
+                            &snr[0],
+                            &requiredSnr[0],
+                            &spreadingFactor[0],
+                            &transmissionPower[0],
+                            &newSpreadingFactor[0],
+                            &newTransmissionPower[0]);
 
-    //If the number of steps is positive (margin_SNR is positive, so its
-    //decimal value is high) increment the data rate, if there are some
-    //leftover steps after reaching the maximum possible data rate
-    //(corresponding to the minimum SF) decrement the transmission power as
-    //well for the number of steps left.
-    //If, on the other hand, the number of steps is negative (margin_SNR is
-    //negative, so its decimal value is low) increase the transmission power
-    //(note that the SF is not incremented as this particular algorithm
-    //expects the node itself to raise its SF whenever necessary).
-    while(steps > 0 && spreadingFactor > min_spreadingFactor)
+    for(size_t i = 0; i < n; i++)
     {
-      spreadingFactor--;
-      steps--;
+      //Devices without enough history keep their current settings
+      decisions[i].dataRate = decisions[i].valid ?
+        SfToDr(newSpreadingFactor[i]) : SfToDr(spreadingFactor[i]);
+      decisions[i].txPower = decisions[i].valid ?
+        uint8_t (newTransmissionPower[i]) : uint8_t (transmissionPower[i]);
+      decisions[i].changed =
+        decisions[i].dataRate != SfToDr(spreadingFactor[i]) ||
+        decisions[i].txPower != uint8_t (transmissionPower[i]);
     }
-    while(steps > 0 && transmissionPower > min_transmissionPower)
+
+    return decisions;
+  }
+
+  void AdrComponent::RegisterDevices (const std::vector<uint32_t> &deviceAddresses)
+  {
+    NS_LOG_FUNCTION (this << deviceAddresses.size ());
+    NS_ASSERT_MSG (m_useIncrementalHistory,
+                   "Replay requires the incremental history");
+
+    //Create all the states now, so that the table is not modified while
+    //the replay runs
+    m_deviceStates.reserve (m_deviceStates.size () + deviceAddresses.size ());
+    for(size_t i = 0; i < deviceAddresses.size (); i++)
+      GetDeviceState (deviceAddresses[i]);
+  }
+
+  void AdrComponent::PrefetchDevice (uint32_t deviceAddress) const
+  {
+    std::unordered_map<uint32_t, uint32_t>::const_iterator it = m_deviceSlots.find (deviceAddress);
+
+    if(it != m_deviceSlots.end ())
     {
-      transmissionPower -= 2;
-      steps--;
+      const char *state = reinterpret_cast<const char *> (&m_deviceStates[it->second]);
+      for(size_t line = 0; line < sizeof (DeviceState); line += 64)
+        __builtin_prefetch (state + line, 1);
+
+      m_deviceStates[it->second].snrHistory.Prefetch ();
     }
-    while(steps < 0 && transmissionPower < max_transmissionPower)
+  }
+
+  AdrComponent::AdrDecision
+  AdrComponent::ReplayUplink (uint32_t deviceAddress,
+                              double time,
+                              uint8_t spreadingFactor,
+                              double transmissionPower,
+                              bool adrRequested,
+                              const double *rxPower,
+                              size_t nGateways)
+  {
+    DeviceState *state = FindDeviceState (deviceAddress);
+    NS_ASSERT_MSG (state, "Device not registered for replay");
+
+    state->historyEpoch++;
+    state->commandPending = false;
+    state->adrRequested = adrRequested;
+    state->spreadingFactor = spreadingFactor;
+    state->transmissionPower = transmissionPower;
+
+    for(size_t g = 0; g < nGateways; g++)
+      AddReception (*state, g == 0, TxPowerToSNR (rxPower[g]));
+
+    AdrDecision decision = DecideOnState (*state);
+    if(!decision.valid)
+      return decision;
+
+    //Same checks as BeforeSendingReply, but for the downlink budget
+    uint8_t rep = GetRepetitions (*state);
+    if(!decision.changed && rep == state->nbTrans)
+      return decision;
+
+    if(time - state->lastCommandTime < minCommandInterval)
     {
-      transmissionPower += 2;
-      steps++;
+      GetCounters ().rateLimited.fetch_add (1, std::memory_order_relaxed);
+      return decision;
     }
 
-    *newDataRate = SfToDr(spreadingFactor);
-    *newTxPower = transmissionPower;
+    RecordCommand (*state, time, rep);
+    GetCounters ().linkAdrReqs.fetch_add (1, std::memory_order_relaxed);
+    decision.command = true;
+
+    return decision;
   }
 
-  uint8_t AdrComponent::SfToDr(uint8_t sf)
+  AdrComponent::AdrDecision
+  AdrComponent::DecideOnState (DeviceState &state)
   {
-    switch (sf)
+    size_t historySize = GetHistorySize (Ptr<EndDeviceStatus> (), &state);
+
+    AdrDecision decision;
+    decision.valid = state.adrRequested && historySize >= GetRequiredHistorySize ();
+    decision.dataRate = SfToDr (state.spreadingFactor);
+    decision.txPower = uint8_t (state.transmissionPower);
+    decision.changed = false;
+    decision.command = false;
+
+    if(decision.valid)
     {
-      case 12:
-        return 0;
-        break;
-      case 11:
-        return 1;
-        break;
-      case 10:
-        return 2;
-        break;
-      case 9:
-        return 3;
-        break;
-      case 8:
-        return 4;
-        break;
-      default:
-        return 5;
-        break;
+      double margin;
+      AdrImplementation (&decision.dataRate,
+                         &decision.txPower,
+                         &margin,
+                         state.spreadingFactor,
+                         state.transmissionPower,
+                         historySize,
+                         Ptr<EndDeviceStatus> (),
+                         &state);
+      decision.changed = decision.dataRate != SfToDr (state.spreadingFactor) ||
+        decision.txPower != uint8_t (state.transmissionPower);
+      RecordDecision (margin, decision.changed);
     }
+    else if(state.adrRequested)
+      GetCounters ().insufficientHistory.fetch_add (1, std::memory_order_relaxed);
+
+    return decision;
   }
 
-  double AdrComponent::TxPowerToSNR (double transmissionPower)
+  AdrComponent::AdrDecision
+  AdrComponent::GetUnknownDeviceDecision (void)
   {
-    //The following conversion ignores interfering packets
-    return transmissionPower + 174 - 10 * log10(B) - NF;
+    AdrDecision decision;
+    decision.valid = false;
+    decision.changed = false;
+    decision.command = false;
+    decision.dataRate = 0;
+    decision.txPower = 0;
+
+    return decision;
   }
 
-  //Get the maximum received power (it considers the values in dB!)
-  double AdrComponent::GetMaxTxFromGateways (EndDeviceStatus::GatewayList gwList)
+  void AdrComponent::SetHistoryFetchCallback (HistoryFetchCallback fetch)
   {
-    EndDeviceStatus::GatewayList::iterator it = gwList.begin();
-    double max = it->second.rxPower;
+    m_historyFetch = fetch;
+  }
+
+  void AdrComponent::RequestDecision (uint32_t deviceAddress, Time deadline,
+                                      DecisionCallback completion)
+  {
+    NS_LOG_FUNCTION (this << deviceAddress << deadline);
+    NS_ASSERT_MSG (m_useIncrementalHistory,
+                   "Asynchronous decisions require the incremental history");
 
-    for(; it != gwList.end(); it++)
+    DeviceState *state = FindDeviceState (deviceAddress);
+    if(!state)
     {
-      if(it->second.rxPower > max)
-        max = it->second.rxPower;
+      //Nothing is known about the settings of the device
+      completion (deviceAddress, GetUnknownDeviceDecision ());
+      return;
     }
 
-    return max;
+    if(m_historyFetch.IsNull ())
+    {
+      completion (deviceAddress, DecideOnState (*state));
+      return;
+    }
+
+    uint64_t requestId = m_nextRequestId++;
+    PendingRequest &request = m_pendingRequests[requestId];
+    request.deviceAddress = deviceAddress;
+    request.completion = completion;
+
+    //A deadline already passed falls back right away
+    Time delay = deadline.IsStrictlyPositive () ? deadline : Seconds (0);
+    request.deadline = Simulator::Schedule (delay, &AdrComponent::OnDecisionDeadline,
+                                            this, requestId);
+
+    m_historyFetch (requestId, deviceAddress);
   }
 
-  //Get the maximum received power
-  double AdrComponent::GetAverageTxFromGateways (EndDeviceStatus::GatewayList gwList)
+  void AdrComponent::DeliverHistory (uint64_t requestId,
+                                     const std::vector<double> &snr)
   {
-    double sum = 0;
+    NS_LOG_FUNCTION (this << requestId << snr.size ());
 
-    for(EndDeviceStatus::GatewayList::iterator it = gwList.begin(); it != gwList.end(); it++)
+    std::unordered_map<uint64_t, PendingRequest>::iterator it =
+      m_pendingRequests.find (requestId);
+    if(it == m_pendingRequests.end ())
     {
-      sum += it->second.rxPower;
+      NS_LOG_DEBUG ("History of request " << requestId << " delivered after its deadline");
+      return;
     }
 
-    return sum / gwList.size();
+    Simulator::Cancel (it->second.deadline);
+    uint32_t deviceAddress = it->second.deviceAddress;
+    DecisionCallback completion = it->second.completion;
+    m_pendingRequests.erase (it);
+
+    //Replace the local history with the fetched one. The states may have
+    //been cleared by a change of the configuration in the meantime.
+    DeviceState *state = FindDeviceState (deviceAddress);
+    if(!state)
+    {
+      completion (deviceAddress, GetUnknownDeviceDecision ());
+      return;
+    }
+
+    if(historyAveraging == EWMA_SNR)
+    {
+      state->snrEwma = SnrEwma ();
+      for(size_t i = 0; i < snr.size (); i++)
+        state->snrEwma.Push (snr[i], ewmaWeight);
+    }
+    else
+    {
+      uint8_t capacity = GetHistoryCapacity ();
+      state->snrHistory.Clear ();
+      for(size_t i = snr.size () > capacity ? snr.size () - capacity : 0; i < snr.size (); i++)
+        state->snrHistory.Push (snr[i]);
+    }
+    state->historyEpoch++;
+
+    completion (deviceAddress, DecideOnState (*state));
   }
 
-  double AdrComponent::GetReceivedPower (EndDeviceStatus::GatewayList gwList)
+  void AdrComponent::OnDecisionDeadline (uint64_t requestId)
   {
-    if(tpAveraging)
-      return GetAverageTxFromGateways(gwList);
-    else
-      return GetMaxTxFromGateways(gwList);
+    NS_LOG_FUNCTION (this << requestId);
+
+    std::unordered_map<uint64_t, PendingRequest>::iterator it =
+      m_pendingRequests.find (requestId);
+    NS_ASSERT (it != m_pendingRequests.end ());
+
+    uint32_t deviceAddress = it->second.deviceAddress;
+    DecisionCallback completion = it->second.completion;
+    m_pendingRequests.erase (it);
+
+    //Use the latest decision taken for the device, whatever packets came
+    //after it, as long as the configuration did not change
+    DeviceState *state = FindDeviceState (deviceAddress);
+    if(!state)
+    {
+      completion (deviceAddress, GetUnknownDeviceDecision ());
+      return;
+    }
+
+    AdrDecision decision;
+    decision.valid = state->cachedDecision.historyEpoch != std::numeric_limits<uint64_t>::max () &&
+      state->cachedDecision.configEpoch == m_configEpoch;
+    decision.dataRate = decision.valid ? state->cachedDecision.dataRate :
+      SfToDr (state->spreadingFactor);
+    decision.txPower = decision.valid ? state->cachedDecision.txPower :
+      uint8_t (state->transmissionPower);
+    decision.changed = decision.dataRate != SfToDr (state->spreadingFactor) ||
+      decision.txPower != uint8_t (state->transmissionPower);
+
+    NS_LOG_DEBUG ("No history for request " << requestId << " within its deadline, using the cached decision");
+    GetCounters ().deadlineFallbacks.fetch_add (1, std::memory_order_relaxed);
+
+    completion (deviceAddress, decision);
   }
 
-  double AdrComponent::GetMaxSNR (EndDeviceStatus::ReceivedPacketList packetList,
-                                  uint8_t historyRange)
+  bool AdrComponent::SaveSnapshot (const std::string &path) const
   {
-    double m_SNR;
+    NS_LOG_FUNCTION (this << path);
 
-    //Take elements from the list starting at the end
-    auto it = packetList.rbegin();
-    double max = TxPowerToSNR(GetReceivedPower(it->second.gwList));
+    FILE *file = std::fopen (path.c_str (), "wb");
+    if(!file)
+    {
+      NS_LOG_WARN ("Cannot open " << path);
+      return false;
+    }
+
+    uint8_t capacity = GetHistoryCapacity ();
+
+    SnapshotHeader header;
+    std::memset (&header, 0, sizeof (header));
+    header.magic = snapshotMagic;
+    header.version = snapshotVersion;
+    header.historyCapacity = capacity;
+    header.ewmaHistory = historyAveraging == EWMA_SNR;
+    header.recordSize = sizeof (SnapshotRecord) + capacity * sizeof (double);
+    header.nDevices = m_deviceStates.size ();
+    header.tpAveraging = tpAveraging;
+    header.snrSource = snrSource;
+    bool ok = std::fwrite (&header, sizeof (header), 1, file) == 1;
 
-    for(int i = 0; i < historyRange; i++, it++)
+    //Records are built in a buffer reused for all the devices. Padding and
+    //the unused samples are zeroed, so that snapshots can be compared.
+    std::vector<char> buffer (header.recordSize);
+    SnapshotRecord *record = reinterpret_cast<SnapshotRecord *> (&buffer[0]);
+    double *samples = reinterpret_cast<double *> (&buffer[sizeof (SnapshotRecord)]);
+
+    for(std::vector<DeviceState, AdrAlignedAllocator<DeviceState> >::const_iterator it =
+          m_deviceStates.begin ();
+        ok && it != m_deviceStates.end (); it++)
     {
-      m_SNR = TxPowerToSNR(GetReceivedPower(it->second.gwList));
+      std::fill (buffer.begin (), buffer.end (), 0);
+      record->deviceAddress = it->deviceAddress;
+      record->lastFCnt = it->lastFCnt;
+      record->fCntValid = it->fCntValid;
+      record->nbTrans = it->nbTrans;
+      record->adrRequested = it->adrRequested;
+      record->spreadingFactor = it->spreadingFactor;
+      record->historySize = it->snrHistory.GetSize ();
+      record->transmissionPower = it->transmissionPower;
+      record->frameLoss = it->frameLoss;
+      record->ewmaPrevious = it->snrEwma.GetPrevious ();
+      record->ewmaEstimate = it->snrEwma.GetEstimate ();
+      record->ewmaCount = it->snrEwma.GetCount ();
+      it->snrHistory.GetSamples (samples);
 
-      if(m_SNR > max)
-        max = m_SNR;
+      ok = std::fwrite (&buffer[0], buffer.size (), 1, file) == 1;
     }
 
-    return max;
+    ok = std::fclose (file) == 0 && ok;
+    if(!ok)
+      NS_LOG_WARN ("Cannot write " << path);
+
+    return ok;
   }
 
-  double AdrComponent::GetAverageSNR (EndDeviceStatus::ReceivedPacketList packetList,
-                                      uint8_t historyRange)
+  bool AdrComponent::LoadSnapshot (const std::string &path)
   {
-    double sum = 0;
-    double m_SNR;
+    NS_LOG_FUNCTION (this << path);
 
-    //Take elements from the list starting at the end
-    auto it = packetList.rbegin();
-    for(int i = 0; i < historyRange; i++, it++)
+    int fd = open (path.c_str (), O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat (fd, &info) != 0 || size_t (info.st_size) < sizeof (SnapshotHeader))
+    {
+      NS_LOG_WARN ("Cannot read " << path);
+      if(fd >= 0)
+        close (fd);
+      return false;
+    }
+
+    size_t size = info.st_size;
+    void *map = mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if(map == MAP_FAILED)
+    {
+      NS_LOG_WARN ("Cannot map " << path);
+      return false;
+    }
+
+    const char *data = static_cast<const char *> (map);
+    SnapshotHeader header;
+    std::memcpy (&header, data, sizeof (header));
+
+    uint8_t capacity = GetHistoryCapacity ();
+    bool ok = m_useIncrementalHistory &&
+      header.magic == snapshotMagic &&
+      header.version == snapshotVersion &&
+      header.historyCapacity == capacity &&
+      header.ewmaHistory == (historyAveraging == EWMA_SNR) &&
+      header.tpAveraging == tpAveraging &&
+      header.snrSource == snrSource &&
+      header.recordSize == sizeof (SnapshotRecord) + capacity * sizeof (double) &&
+      size == sizeof (header) + size_t (header.nDevices) * header.recordSize;
+
+    if(!ok)
+      NS_LOG_WARN ("Snapshot " << path << " does not match the configuration of the component");
+
+    for(uint32_t i = 0; ok && i < header.nDevices; i++)
     {
-      m_SNR = TxPowerToSNR(GetReceivedPower(it->second.gwList));
+      //Records start at multiples of 8 bytes from the page aligned map,
+      //so they can be read in place
+      const char *p = data + sizeof (header) + size_t (i) * header.recordSize;
+      const SnapshotRecord *record = reinterpret_cast<const SnapshotRecord *> (p);
+      const double *samples = reinterpret_cast<const double *> (p + sizeof (SnapshotRecord));
+
+      DeviceState &state = GetDeviceState (record->deviceAddress);
 
-      sum += m_SNR;
+      //Packets and times of the previous run do not carry over
+      state = DeviceState (record->deviceAddress, state.snrHistory);
+      state.lastFCnt = record->lastFCnt;
+      state.fCntValid = record->fCntValid;
+      state.nbTrans = record->nbTrans;
+      state.adrRequested = record->adrRequested;
+      state.spreadingFactor = record->spreadingFactor;
+      state.transmissionPower = record->transmissionPower;
+      state.frameLoss = record->frameLoss;
+      state.snrEwma.Restore (record->ewmaPrevious, record->ewmaEstimate,
+                             record->ewmaCount);
+      for(uint8_t s = 0; s < std::min (record->historySize, capacity); s++)
+        state.snrHistory.Push (samples[s]);
     }
 
-    return sum / historyRange;
+    munmap (map, size);
+    return ok;
   }
 
-  int AdrComponent::GetTxPowerIndex (int txPower)
+  void AdrComponent::AdrImplementation(uint8_t *newDataRate,
+                         uint8_t *newTxPower,
+                         double *margin,
+                         uint8_t spreadingFactor,
+                         double transmissionPower,
+                         size_t historySize,
+                         Ptr<EndDeviceStatus> status,
+                         DeviceState *state) const
   {
-    if(txPower >= 16)
-      return 0;
-    else if(txPower >= 14)
-      return 1;
-    else if(txPower >= 12)
-      return 2;
-    else if(txPower >= 10)
-      return 3;
-    else if(txPower >= 8)
-      return 4;
-    else if(txPower >= 6)
-      return 5;
-    else if(txPower >= 4)
-      return 6;
-    else
-      return 7;
+    //If no packet was received and neither the settings of the device nor
+    //the configuration changed since the latest decision, reuse it. In the
+    //precompute mode new packets do not matter: they are taken into
+    //account by the next run of PrecomputeDecisions.
+    bool historyValid = state &&
+      (state->cachedDecision.historyEpoch == state->historyEpoch ||
+       (!precomputeInterval.IsZero () &&
+        state->cachedDecision.historyEpoch != std::numeric_limits<uint64_t>::max ()));
+
+    if(historyValid &&
+       state->cachedDecision.configEpoch == m_configEpoch &&
+       state->cachedDecision.spreadingFactor == spreadingFactor &&
+       state->cachedDecision.transmissionPower == transmissionPower)
+    {
+      *newDataRate = state->cachedDecision.dataRate;
+      *newTxPower = state->cachedDecision.txPower;
+      *margin = state->cachedDecision.margin;
+      return;
+    }
+
+    ComputeDecision(newDataRate,
+                    newTxPower,
+                    margin,
+                    spreadingFactor,
+                    transmissionPower,
+                    historySize,
+                    status,
+                    state);
+  }
+
+  void AdrComponent::ComputeDecision(uint8_t *newDataRate,
+                                     uint8_t *newTxPower,
+                                     double *margin,
+                                     uint8_t spreadingFactor,
+                                     double transmissionPower,
+                                     size_t historySize,
+                                     Ptr<EndDeviceStatus> status,
+                                     DeviceState *state) const
+  {
+    //Compute the maximum or median SNR, based on historyAveraging, and
+    //during the warm-up leave room for the estimate being less accurate
+    double m_SNR = GetHistorySNR (status, state) - GetHistoryWarmUpMargin (historySize);
+
+    *margin = ComputeAdrSettings(m_SNR,
+                                 spreadingFactor,
+                                 transmissionPower,
+                                 newDataRate,
+                                 newTxPower);
+
+    if(state)
+    {
+      state->cachedDecision.historyEpoch = state->historyEpoch;
+      state->cachedDecision.configEpoch = m_configEpoch;
+      state->cachedDecision.spreadingFactor = spreadingFactor;
+      state->cachedDecision.transmissionPower = transmissionPower;
+      state->cachedDecision.dataRate = *newDataRate;
+      state->cachedDecision.txPower = *newTxPower;
+      state->cachedDecision.margin = *margin;
+    }
+  }
+
+  double AdrComponent::ComputeAdrSettings(double m_SNR,
+                                          uint8_t spreadingFactor,
+                                          double transmissionPower,
+                                          uint8_t *newDataRate,
+                                          uint8_t *newTxPower) const
+  {
+    //Get the device data rate and use it to get the SNR demodulation treshold
+    double req_SNR = treshold[SfToIndex(spreadingFactor)];
+
+    //Compute the SNR margin taking into consideration the SNR of
+    //previously received packets
+    double margin_SNR = m_SNR - req_SNR - offset;
+
+    //Margins in [0, 3) dB leave the device unchanged: with hysteresis,
+    //widen this band on both sides
+    double step_SNR = margin_SNR;
+    if(step_SNR >= 3)
+      step_SNR = std::max(step_SNR - hysteresis, 0.0);
+    else if(step_SNR < 0)
+      step_SNR = std::min(step_SNR + hysteresis, 0.0);
+
+    //Number of steps to decrement the SF (thereby increasing the Data Rate)
+    //and the TP.
+    int steps = FloorToInt(step_SNR / 3);
+
+    //If the number of steps is positive (margin_SNR is positive, so its
+    //decimal value is high) increment the data rate, if there are some
+    //leftover steps after reaching the maximum possible data rate
+    //(corresponding to the minimum SF) decrement the transmission power as
+    //well for the number of steps left.
+    //If, on the other hand, the number of steps is negative (margin_SNR is
+    //negative, so its decimal value is low) increase the transmission power
+    //(note that the SF is not incremented as this particular algorithm
+    //expects the node itself to raise its SF whenever necessary).
+    ApplyAdrSteps(steps,
+                  min_spreadingFactor,
+                  m_minTransmissionPower,
+                  m_maxTransmissionPower,
+                  &spreadingFactor,
+                  &transmissionPower);
+
+    //In the capacity mode, the SF may be left higher than needed
+    if(airtimeAware)
+      spreadingFactor = SelectCapacitySpreadingFactor (spreadingFactor);
+
+    *newDataRate = SfToDr(spreadingFactor);
+    *newTxPower = transmissionPower;
+
+    return margin_SNR;
+  }
+
+  void AdrComponent::ApplyAdrSteps (int steps,
+                                    int minSpreadingFactor,
+                                    int minTransmissionPower,
+                                    int maxTransmissionPower,
+                                    uint8_t *spreadingFactor,
+                                    double *transmissionPower)
+  {
+    //The number of steps spent on each setting is the requested one,
+    //clamped to the room left before the corresponding limit
+    int sfRoom = std::max(*spreadingFactor - minSpreadingFactor, 0);
+    int sfSteps = std::min(std::max(steps, 0), sfRoom);
+    steps -= sfSteps;
+
+    //TP changes in 2 dB steps, until it reaches or crosses the limit
+    int tpDownRoom = std::max(CeilToInt((*transmissionPower - minTransmissionPower) / 2), 0);
+    int tpUpRoom = std::max(CeilToInt((maxTransmissionPower - *transmissionPower) / 2), 0);
+    int tpSteps = std::min(std::max(-steps, 0), tpUpRoom) -
+                  std::min(std::max(steps, 0), tpDownRoom);
+
+    *spreadingFactor -= sfSteps;
+    *transmissionPower += 2 * tpSteps;
+  }
+
+  void AdrComponent::ComputeAdrSettingsBatch(size_t n,
+                                              const double *m_SNR,
+                                              const double *req_SNR,
+                                              const uint8_t *spreadingFactor,
+                                              const double *transmissionPower,
+                                              uint8_t *newSpreadingFactor,
+                                              double *newTransmissionPower) const
+  {
+    //Copy the parameters, so that the compiler does not have to assume
+    //the stores to the arrays change them
+    const double offset = this->offset;
+    const double hysteresis = this->hysteresis;
+    const int minSpreadingFactor = min_spreadingFactor;
+    const int minTransmissionPower = m_minTransmissionPower;
+    const int maxTransmissionPower = m_maxTransmissionPower;
+
+    //Same computation as ComputeAdrSettings, over the arrays and with
+    //ApplyAdrSteps inlined. The loop has no branches nor table lookups, so
+    //that the compiler vectorizes it.
+    for(size_t i = 0; i < n; i++)
+    {
+      double margin = m_SNR[i] - req_SNR[i] - offset;
+
+      double lowered = margin - hysteresis;
+      double raised = margin + hysteresis;
+      lowered = lowered > 0 ? lowered : 0;
+      raised = raised < 0 ? raised : 0;
+      double step = margin >= 3 ? lowered : margin < 0 ? raised : margin;
+
+      uint8_t sf = spreadingFactor[i];
+      double tp = transmissionPower[i];
+      ApplyAdrSteps(FloorToInt(step / 3),
+                    minSpreadingFactor,
+                    minTransmissionPower,
+                    maxTransmissionPower,
+                    &sf,
+                    &tp);
+
+      newSpreadingFactor[i] = sf;
+      newTransmissionPower[i] = tp;
+    }
+
+    //In the capacity mode, the SF may be left higher than needed. This
+    //depends on the load table, so it is done in a second pass.
+    if(airtimeAware)
+      for(size_t i = 0; i < n; i++)
+        newSpreadingFactor[i] = SelectCapacitySpreadingFactor (newSpreadingFactor[i]);
+  }
+
+  //Get the maximum received power (it considers the values in dB!)
+  double AdrComponent::GetMaxTxFromGateways (const EndDeviceStatus::GatewayList &gwList)
+  {
+    //Copy the powers in a contiguous buffer, one chunk at a time, and
+    //reduce each chunk with the vectorized kernel
+    double rxPower[gwChunkSize];
+    double max = gwList.begin()->second.rxPower;
+    size_t n = 0;
+
+    for(EndDeviceStatus::GatewayList::const_iterator it = gwList.begin(); it != gwList.end(); it++)
+    {
+      rxPower[n++] = it->second.rxPower;
+
+      if(n == gwChunkSize)
+      {
+        max = std::max(max, AdrReduceMax(rxPower, n));
+        n = 0;
+      }
+    }
+    if(n > 0)
+      max = std::max(max, AdrReduceMax(rxPower, n));
+
+    return max;
+  }
+
+  //Get the average received power
+  double AdrComponent::GetAverageTxFromGateways (const EndDeviceStatus::GatewayList &gwList)
+  {
+    double rxPower[gwChunkSize];
+    double sum = 0;
+    size_t n = 0;
+
+    for(EndDeviceStatus::GatewayList::const_iterator it = gwList.begin(); it != gwList.end(); it++)
+    {
+      rxPower[n++] = it->second.rxPower;
+
+      if(n == gwChunkSize)
+      {
+        sum += AdrReduceSum(rxPower, n);
+        n = 0;
+      }
+    }
+    sum += AdrReduceSum(rxPower, n);
+
+    return sum / gwList.size();
+  }
+
+  double AdrComponent::GetCombinedTxFromGateways (const EndDeviceStatus::GatewayList &gwList)
+  {
+    //When the buffer is full, its sum takes the first slot and the next
+    //powers are added after it
+    double rxPower[gwChunkSize + 1];
+    size_t n = 0;
+
+    for(EndDeviceStatus::GatewayList::const_iterator it = gwList.begin(); it != gwList.end(); it++)
+    {
+      rxPower[n++] = it->second.rxPower;
+
+      if(n == gwChunkSize + 1)
+      {
+        rxPower[0] = AdrReducePowerSum(rxPower, n);
+        n = 1;
+      }
+    }
+
+    return AdrReducePowerSum(rxPower, n);
+  }
+
+  double AdrComponent::GetAirtimeGain (uint8_t spreadingFactor,
+                                       uint8_t dataRate) const
+  {
+    //Fastest SF of the region at the data rate
+    int index = 5;
+    while(index > 0 && m_region->dataRate[index] != dataRate)
+      index--;
+
+    return airtime[SfToIndex(spreadingFactor)] - airtime[index];
+  }
+
+  bool AdrComponent::AdmitCommand (Ptr<NetworkStatus> networkStatus,
+                                   LoraDeviceAddress deviceAddress,
+                                   double gain, bool restoresLink,
+                                   DeviceState *state)
+  {
+    if(state)
+      state->commandBudget = 0;
+
+    if(downlinkBudget == 0)
+      return true;
+
+    //The reply goes through the best gateway for the first receive window
+    Address gateway = networkStatus->GetBestGatewayForDevice (deviceAddress, 1);
+    double now = Simulator::Now ().GetSeconds ();
+
+    GatewayBudget initial;
+    initial.tokens = downlinkBudget;
+    initial.updated = now;
+    initial.averageGain = 0;
+    GatewayBudget &budget =
+      m_gatewayBudgets.insert (std::make_pair (gateway, initial)).first->second;
+
+    budget.tokens = std::min<double> (downlinkBudget, budget.tokens +
+                                      (now - budget.updated) * downlinkBudget / budgetWindow);
+    budget.updated = now;
+
+    //Commands restoring the link of a device always come first, and are
+    //left out of the average. Deferred commands are retried on later
+    //replies, so only the admitted ones are averaged, each once.
+    bool admitted = budget.tokens >= 1 &&
+      (restoresLink || budget.tokens >= downlinkBudget / 2.0 || gain >= budget.averageGain);
+
+    double gainChange = 0;
+    if(admitted && !restoresLink)
+    {
+      gainChange = (gain - budget.averageGain) / downlinkBudget;
+      budget.averageGain += gainChange;
+    }
+
+    if(admitted)
+    {
+      budget.tokens--;
+
+      if(state)
+      {
+        state->commandBudget = &budget;
+        state->commandGainChange = gainChange;
+        state->commandBudgetEpoch = m_budgetEpoch;
+      }
+    }
+
+    return admitted;
+  }
+
+  LoraFrameHeader AdrComponent::GetFrameHeader (Ptr<const Packet> packet)
+  {
+    Ptr<Packet> myPacket = packet->Copy();
+    LoraMacHeader mHdr;
+    LoraFrameHeader fHdr;
+    fHdr.SetAsUplink ();
+    myPacket->RemoveHeader(mHdr);
+    myPacket->RemoveHeader(fHdr);
+
+    return fHdr;
+  }
+
+  bool AdrComponent::GetAdrBit (Ptr<const Packet> packet)
+  {
+    return GetFrameHeader(packet).GetAdr();
+  }
+
+  size_t AdrComponent::GetHistorySize (Ptr<EndDeviceStatus> status,
+                                       const DeviceState *state) const
+  {
+    if(!m_useIncrementalHistory)
+      return status->GetReceivedPacketList().size();
+    else if(!state)
+      return 0;
+    else if(historyAveraging == EWMA_SNR)
+      return state->snrEwma.GetCount ();
+    else
+      return state->snrHistory.GetSize ();
+  }
+
+  AdrComponent::GatewaySelection
+  AdrComponent::GetGatewaySelection (uint8_t spreadingFactor) const
+  {
+    GatewaySelection selection;
+    selection.k = topKGateways;
+    selection.floor = treshold[SfToIndex(spreadingFactor)];
+
+    return selection;
+  }
+
+  double AdrComponent::GetTopKTxFromGateways (const EndDeviceStatus::GatewayList &gwList,
+                                              const GatewaySelection &selection)
+  {
+    //Collect the receptions above the floor in a fixed buffer. When it is
+    //full, move the k strongest to the front and drop the others, so that
+    //the cost stays linear in the number of gateways.
+    double rxPower[gwChunkSize];
+    double max = gwList.begin()->second.rxPower;
+    size_t n = 0;
+
+    for(EndDeviceStatus::GatewayList::const_iterator it = gwList.begin(); it != gwList.end(); it++)
+    {
+      double power = it->second.rxPower;
+      max = std::max(max, power);
+
+      if(TxPowerToSNR(power) < selection.floor)
+        continue;
+
+      rxPower[n++] = power;
+
+      if(n == gwChunkSize)
+      {
+        std::nth_element(rxPower, rxPower + selection.k - 1, rxPower + n,
+                         std::greater<double>());
+        n = selection.k;
+      }
+    }
+
+    //No gateway above the floor: use the strongest one
+    if(n == 0)
+      return max;
+
+    size_t k = std::min(n, size_t (selection.k));
+    std::nth_element(rxPower, rxPower + k - 1, rxPower + n,
+                     std::greater<double>());
+
+    return AdrReduceSum(rxPower, k) / k;
+  }
+
+  uint8_t AdrComponent::SelectCapacitySpreadingFactor (uint8_t minSpreadingFactor) const
+  {
+    //Devices hop among the channels, so use the average load of each SF
+    //over them
+    uint8_t nChannels = std::max (m_nLoadChannels, uint8_t (1));
+    uint8_t best = minSpreadingFactor;
+    double bestCost = std::numeric_limits<double>::max ();
+
+    for(uint8_t sf = minSpreadingFactor; sf <= m_region->maxSpreadingFactor; sf++)
+    {
+      double load = 0;
+      for(uint8_t c = 0; c < m_nLoadChannels; c++)
+        load += m_load[SfToIndex(sf)][c];
+      load /= nChannels;
+
+      //SFs are quasi-orthogonal: with pure ALOHA on each of them a frame
+      //is delivered with probability exp(-2 * load), so on average it
+      //takes airtime / exp(-2 * load) to deliver one
+      double cost = airtime[SfToIndex(sf)] * std::exp (2 * load);
+      if(cost < bestCost)
+      {
+        best = sf;
+        bestCost = cost;
+      }
+    }
+
+    return best;
+  }
+
+  void AdrComponent::UpdateLoad (uint8_t spreadingFactor, double frequency)
+  {
+    double now = Simulator::Now ().GetSeconds ();
+    double decay = std::exp (-(now - m_loadUpdated) / loadWindow);
+    m_loadUpdated = now;
+
+    uint8_t c = 0;
+    while(c < m_nLoadChannels && m_loadChannels[c] != frequency)
+      c++;
+
+    if(c == m_nLoadChannels && m_nLoadChannels < maxLoadChannels)
+      m_loadChannels[m_nLoadChannels++] = frequency;
+    else if(c == maxLoadChannels)
+      c = maxLoadChannels - 1;
+
+    for(int dr = 0; dr < 6; dr++)
+    {
+      for(uint8_t i = 0; i < m_nLoadChannels; i++)
+        m_load[dr][i] *= decay;
+    }
+
+    //Each uplink adds its airtime, spread over the time constant
+    m_load[SfToIndex(spreadingFactor)][c] += airtime[SfToIndex(spreadingFactor)] / loadWindow;
+  }
+
+  size_t AdrComponent::GetRequiredHistorySize (void) const
+  {
+    if(warmUpSamples == 0)
+      return historyRange;
+    else
+      return std::min (warmUpSamples, historyRange);
+  }
+
+  double AdrComponent::GetHistoryWarmUpMargin (size_t historySize) const
+  {
+    size_t required = GetRequiredHistorySize ();
+
+    if(historySize >= historyRange)
+      return 0;
+    else
+      return warmUpMargin * (historyRange - historySize) /
+        (historyRange - required);
+  }
+
+  double AdrComponent::GetHistorySNR (Ptr<EndDeviceStatus> status,
+                                      const DeviceState *state) const
+  {
+    return (this->*m_historySnr) (status, state);
+  }
+
+  template <class HistoryPolicy>
+  double AdrComponent::GetIncrementalHistorySNR (Ptr<EndDeviceStatus> status,
+                                                 const DeviceState *state) const
+  {
+    NS_ASSERT (state);
+
+    return HistoryPolicy::FromHistory (*state);
+  }
+
+  template <class TpPolicy, class HistoryPolicy>
+  double AdrComponent::GetScannedHistorySNR (Ptr<EndDeviceStatus> status,
+                                             const DeviceState *state) const
+  {
+    const EndDeviceStatus::ReceivedPacketList &packetList =
+      status->GetReceivedPacketList();
+    double m_SNR[UINT8_MAX];
+
+    //During the warm-up fewer than historyRange packets may be available
+    size_t size = std::min (packetList.size(), size_t (historyRange));
+    if(size == 0)
+      return 0;
+
+    //Take elements from the list starting at the end
+    auto it = packetList.rbegin();
+    for(size_t i = 0; i < size; i++, it++)
+    {
+      GatewaySelection selection = GetGatewaySelection (it->second.sf);
+      m_SNR[i] = TxPowerToSNR(TpPolicy::FromGateways(it->second.gwList, selection));
+    }
+
+    return HistoryPolicy::FromSamples(m_SNR, size);
+  }
+
+  void AdrComponent::SelectPolicies (void)
+  {
+    m_configEpoch++;
+
+    m_minTransmissionPower = std::max (min_transmissionPower,
+                                       m_region->minTransmissionPower);
+    m_maxTransmissionPower = std::min (max_transmissionPower,
+                                       m_region->maxTransmissionPower);
+
+    m_enabledChannels.assign (m_region->channels,
+                              m_region->channels + m_region->nChannels);
+
+    if(tpAveraging == MAX_TX_POWER)
+      m_receptionsSnr = &MaxPolicy::FromReceptions;
+    else if(tpAveraging == TOP_K_TX_POWER)
+      m_receptionsSnr = &TopKPolicy::FromReceptions;
+    else if(tpAveraging == COMBINED_TX_POWER)
+      m_receptionsSnr = &CombinedPolicy::FromReceptions;
+    else
+      m_receptionsSnr = &AveragePolicy::FromReceptions;
+
+    //The gateway list only holds the received power, so the measured SNR
+    //can only be collected on reception
+    m_useIncrementalHistory = incrementalHistory || historyAveraging == EWMA_SNR ||
+      snrSource == MEASURED_SNR;
+
+    //With the incremental history the gateways are combined on reception,
+    //so TpPolicy is not used
+    if(historyAveraging == EWMA_SNR)
+      m_historySnr = &AdrComponent::GetIncrementalHistorySNR<EwmaPolicy>;
+    else if(m_useIncrementalHistory && historyAveraging == MAX_SNR)
+      m_historySnr = &AdrComponent::GetIncrementalHistorySNR<MaxPolicy>;
+    else if(m_useIncrementalHistory)
+      m_historySnr = &AdrComponent::GetIncrementalHistorySNR<AveragePolicy>;
+    else if(tpAveraging == MAX_TX_POWER && historyAveraging == MAX_SNR)
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<MaxPolicy, MaxPolicy>;
+    else if(tpAveraging == MAX_TX_POWER)
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<MaxPolicy, AveragePolicy>;
+    else if(tpAveraging == TOP_K_TX_POWER && historyAveraging == MAX_SNR)
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<TopKPolicy, MaxPolicy>;
+    else if(tpAveraging == TOP_K_TX_POWER)
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<TopKPolicy, AveragePolicy>;
+    else if(tpAveraging == COMBINED_TX_POWER && historyAveraging == MAX_SNR)
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<CombinedPolicy, MaxPolicy>;
+    else if(tpAveraging == COMBINED_TX_POWER)
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<CombinedPolicy, AveragePolicy>;
+    else if(historyAveraging == MAX_SNR)
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<AveragePolicy, MaxPolicy>;
+    else
+      m_historySnr = &AdrComponent::GetScannedHistorySNR<AveragePolicy, AveragePolicy>;
+  }
+
+  void AdrComponent::SetTpAveraging (TpAveragingPolicy policy)
+  {
+    //The incremental history combined the samples under the old policy
+    if(policy != tpAveraging && m_useIncrementalHistory)
+      ClearDeviceStates ();
+
+    tpAveraging = policy;
+    SelectPolicies ();
+  }
+
+  AdrComponent::Counters &
+  AdrComponent::GetCounters (void)
+  {
+    static std::atomic<unsigned> nextSlot (0);
+    static thread_local unsigned slot =
+      nextSlot.fetch_add (1, std::memory_order_relaxed) % counterSlots;
+
+    return m_counters[slot];
+  }
+
+  void AdrComponent::RecordDecision (double margin, bool changed)
+  {
+    Counters &counters = GetCounters ();
+
+    counters.decisions.fetch_add (1, std::memory_order_relaxed);
+    if(!changed)
+      counters.unchanged.fetch_add (1, std::memory_order_relaxed);
+
+    int bucket = std::floor ((margin - minMargin) / marginBucketWidth);
+    bucket = std::min (std::max (bucket, 0), marginBuckets - 1);
+    counters.marginHistogram[bucket].fetch_add (1, std::memory_order_relaxed);
+
+    int steps = std::floor (margin / 3);
+    bucket = std::min (std::max (steps - minSteps, 0), stepBuckets - 1);
+    counters.stepHistogram[bucket].fetch_add (1, std::memory_order_relaxed);
+  }
+
+  AdrComponent::Statistics
+  AdrComponent::GetStatistics (void) const
+  {
+    Statistics statistics = Statistics ();
+
+    for(unsigned slot = 0; slot < counterSlots; slot++)
+    {
+      const Counters &counters = m_counters[slot];
+
+      statistics.decisions += counters.decisions.load (std::memory_order_relaxed);
+      statistics.insufficientHistory += counters.insufficientHistory.load (std::memory_order_relaxed);
+      statistics.linkAdrReqs += counters.linkAdrReqs.load (std::memory_order_relaxed);
+      statistics.unchanged += counters.unchanged.load (std::memory_order_relaxed);
+      statistics.rateLimited += counters.rateLimited.load (std::memory_order_relaxed);
+      statistics.budgetLimited += counters.budgetLimited.load (std::memory_order_relaxed);
+      statistics.deadlineFallbacks += counters.deadlineFallbacks.load (std::memory_order_relaxed);
+
+      for(int i = 0; i < marginBuckets; i++)
+        statistics.marginHistogram[i] += counters.marginHistogram[i].load (std::memory_order_relaxed);
+      for(int i = 0; i < stepBuckets; i++)
+        statistics.stepHistogram[i] += counters.stepHistogram[i].load (std::memory_order_relaxed);
+    }
+
+    return statistics;
+  }
+
+  void AdrComponent::ResetStatistics (void)
+  {
+    for(unsigned slot = 0; slot < counterSlots; slot++)
+    {
+      Counters &counters = m_counters[slot];
+
+      counters.decisions.store (0, std::memory_order_relaxed);
+      counters.insufficientHistory.store (0, std::memory_order_relaxed);
+      counters.linkAdrReqs.store (0, std::memory_order_relaxed);
+      counters.unchanged.store (0, std::memory_order_relaxed);
+      counters.rateLimited.store (0, std::memory_order_relaxed);
+      counters.budgetLimited.store (0, std::memory_order_relaxed);
+      counters.deadlineFallbacks.store (0, std::memory_order_relaxed);
+
+      for(int i = 0; i < marginBuckets; i++)
+        counters.marginHistogram[i].store (0, std::memory_order_relaxed);
+      for(int i = 0; i < stepBuckets; i++)
+        counters.stepHistogram[i].store (0, std::memory_order_relaxed);
+    }
+  }
+
+  void AdrComponent::Statistics::Print (std::ostream &os) const
+  {
+    os << "decisions " << decisions
+       << " insufficientHistory " << insufficientHistory
+       << " linkAdrReqs " << linkAdrReqs
+       << " unchanged " << unchanged
+       << " rateLimited " << rateLimited
+       << " budgetLimited " << budgetLimited
+       << " deadlineFallbacks " << deadlineFallbacks << std::endl;
+
+    os << "margin (dB):";
+    for(int i = 0; i < marginBuckets; i++)
+      os << " " << minMargin + i * marginBucketWidth << ":" << marginHistogram[i];
+    os << std::endl;
+
+    os << "steps:";
+    for(int i = 0; i < stepBuckets; i++)
+      os << " " << minSteps + i << ":" << stepHistogram[i];
+    os << std::endl;
+  }
+
+  void AdrComponent::PrecomputeDecisions (void)
+  {
+    NS_LOG_FUNCTION (this << m_deviceStates.size ());
+
+    if(!m_useIncrementalHistory)
+      NS_LOG_WARN ("Decisions can only be precomputed with the incremental history");
+    else
+    {
+      for(size_t i = 0; i < m_deviceStates.size (); i++)
+      {
+        DeviceState &state = m_deviceStates[i];
+
+        size_t historySize = GetHistorySize (Ptr<EndDeviceStatus> (), &state);
+        if(historySize < GetRequiredHistorySize ())
+          continue;
+
+        uint8_t newDataRate;
+        uint8_t newTxPower;
+        double margin;
+        ComputeDecision (&newDataRate,
+                         &newTxPower,
+                         &margin,
+                         state.spreadingFactor,
+                         state.transmissionPower,
+                         historySize,
+                         Ptr<EndDeviceStatus> (),
+                         &state);
+      }
+    }
+
+    m_precomputeEvent = Simulator::Schedule (precomputeInterval,
+                                             &AdrComponent::PrecomputeDecisions,
+                                             this);
+  }
+
+  void AdrComponent::SetPrecomputeInterval (Time interval)
+  {
+    NS_ASSERT (!interval.IsStrictlyNegative ());
+
+    precomputeInterval = interval;
+    Simulator::Cancel (m_precomputeEvent);
+
+    if(!precomputeInterval.IsZero ())
+      m_precomputeEvent = Simulator::Schedule (precomputeInterval,
+                                               &AdrComponent::PrecomputeDecisions,
+                                               this);
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetHysteresis (double hysteresis)
+  {
+    this->hysteresis = hysteresis;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetMinCommandInterval (Time interval)
+  {
+    minCommandInterval = interval.GetSeconds ();
+  }
+
+  void AdrComponent::SetDownlinkBudget (uint32_t budget)
+  {
+    downlinkBudget = budget;
+    m_gatewayBudgets.clear ();
+    m_budgetEpoch++;
+  }
+
+  void AdrComponent::SetBudgetWindow (Time window)
+  {
+    NS_ASSERT (window.IsStrictlyPositive ());
+
+    budgetWindow = window.GetSeconds ();
+    m_gatewayBudgets.clear ();
+    m_budgetEpoch++;
+  }
+
+  void AdrComponent::SetMaxRepetitions (uint8_t repetitions)
+  {
+    maxRepetitions = repetitions;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetTargetFrameLoss (double loss)
+  {
+    targetFrameLoss = loss;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetAirtimeAware (bool airtimeAware)
+  {
+    this->airtimeAware = airtimeAware;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetLoadWindow (Time window)
+  {
+    NS_ASSERT (window.GetSeconds () > 0);
+
+    loadWindow = window.GetSeconds ();
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetTopKGateways (uint8_t k)
+  {
+    NS_ASSERT (k > 0 && k <= maxTopKGateways);
+
+    topKGateways = k;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetHistoryRange (uint8_t range)
+  {
+    NS_ASSERT (range > 0);
+
+    //The per-device histories are sized on historyRange: start over
+    historyRange = range;
+    ClearDeviceStates ();
+  }
+
+  void AdrComponent::SetHistoryAveraging (HistoryAveragingPolicy policy)
+  {
+    //The EWMA policy keeps a different history
+    if((policy == EWMA_SNR) != (historyAveraging == EWMA_SNR))
+      ClearDeviceStates ();
+
+    historyAveraging = policy;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetIncrementalHistory (bool incremental)
+  {
+    //Histories collected so far are not valid in the other mode
+    if(incremental != incrementalHistory)
+      ClearDeviceStates ();
+
+    incrementalHistory = incremental;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetEwmaWeight (double weight)
+  {
+    ewmaWeight = weight;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetSnrSource (SnrSource source)
+  {
+    //The SNR collected so far may come from the other source
+    if(source != snrSource)
+      ClearDeviceStates ();
+
+    snrSource = source;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetRegion (Region region)
+  {
+    static const AdrRegionProfile *const profiles[] =
+      {&EU868_ADR_PROFILE, &US915_ADR_PROFILE, &AS923_ADR_PROFILE};
+
+    this->region = region;
+    m_region = profiles[region];
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetMinSpreadingFactor (int sf)
+  {
+    min_spreadingFactor = sf;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetMinTransmissionPower (int txPower)
+  {
+    min_transmissionPower = txPower;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetMaxTransmissionPower (int txPower)
+  {
+    max_transmissionPower = txPower;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetOffset (int offset)
+  {
+    this->offset = offset;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetWarmUpSamples (uint8_t samples)
+  {
+    warmUpSamples = samples;
+    SelectPolicies ();
+  }
+
+  void AdrComponent::SetWarmUpMargin (double margin)
+  {
+    warmUpMargin = margin;
+    SelectPolicies ();
+  }
+
+  AdrComponent::TpAveragingPolicy
+  AdrComponent::GetTpAveraging (void) const
+  {
+    return tpAveraging;
+  }
+
+  uint8_t AdrComponent::GetHistoryRange (void) const
+  {
+    return historyRange;
+  }
+
+  uint8_t AdrComponent::GetTopKGateways (void) const
+  {
+    return topKGateways;
+  }
+
+  AdrComponent::HistoryAveragingPolicy
+  AdrComponent::GetHistoryAveraging (void) const
+  {
+    return historyAveraging;
+  }
+
+  bool AdrComponent::GetIncrementalHistory (void) const
+  {
+    return incrementalHistory;
+  }
+
+  double AdrComponent::GetEwmaWeight (void) const
+  {
+    return ewmaWeight;
+  }
+
+  AdrComponent::SnrSource
+  AdrComponent::GetSnrSource (void) const
+  {
+    return snrSource;
+  }
+
+  AdrComponent::Region
+  AdrComponent::GetRegion (void) const
+  {
+    return region;
+  }
+
+  int AdrComponent::GetMinSpreadingFactor (void) const
+  {
+    return min_spreadingFactor;
+  }
+
+  int AdrComponent::GetMinTransmissionPower (void) const
+  {
+    return min_transmissionPower;
+  }
+
+  int AdrComponent::GetMaxTransmissionPower (void) const
+  {
+    return max_transmissionPower;
+  }
+
+  int AdrComponent::GetOffset (void) const
+  {
+    return offset;
+  }
+
+  uint8_t AdrComponent::GetWarmUpSamples (void) const
+  {
+    return warmUpSamples;
+  }
+
+  double AdrComponent::GetWarmUpMargin (void) const
+  {
+    return warmUpMargin;
+  }
+
+  bool AdrComponent::GetAirtimeAware (void) const
+  {
+    return airtimeAware;
+  }
+
+  Time AdrComponent::GetLoadWindow (void) const
+  {
+    return Seconds (loadWindow);
+  }
+
+  Time AdrComponent::GetPrecomputeInterval (void) const
+  {
+    return precomputeInterval;
+  }
+
+  double AdrComponent::GetHysteresis (void) const
+  {
+    return hysteresis;
+  }
+
+  Time AdrComponent::GetMinCommandInterval (void) const
+  {
+    return Seconds (minCommandInterval);
+  }
+
+  uint32_t AdrComponent::GetDownlinkBudget (void) const
+  {
+    return downlinkBudget;
+  }
+
+  Time AdrComponent::GetBudgetWindow (void) const
+  {
+    return Seconds (budgetWindow);
+  }
+
+  uint8_t AdrComponent::GetMaxRepetitions (void) const
+  {
+    return maxRepetitions;
+  }
+
+  double AdrComponent::GetTargetFrameLoss (void) const
+  {
+    return targetFrameLoss;
+  }
+
+  void AdrComponent::UpdateFrameLoss (DeviceState &state, uint16_t fCnt) const
+  {
+    uint16_t gap = fCnt - state.lastFCnt;
+
+    //The repetitions of a frame carry the same counter
+    if(state.fCntValid && gap == 0)
+      return;
+
+    //Average the loss over about historyRange frames: the gap - 1 frames
+    //missing before this one count as lost, this one as received
+    if(state.fCntValid && gap <= maxFCntGap)
+    {
+      double weight = 1.0 / historyRange;
+      double kept = std::pow (1 - weight, gap - 1);
+      state.frameLoss = (1 - (1 - state.frameLoss) * kept) * (1 - weight);
+    }
+
+    state.lastFCnt = fCnt;
+    state.fCntValid = true;
+  }
+
+  void AdrComponent::RecordCommand (DeviceState &state, double now, uint8_t rep)
+  {
+    state.commandPending = true;
+    state.previousCommandTime = state.lastCommandTime;
+    state.previousNbTrans = state.nbTrans;
+    state.lastCommandTime = now;
+    state.nbTrans = rep;
+  }
+
+  uint8_t AdrComponent::GetRepetitions (const DeviceState &state) const
+  {
+    //A frame is lost when all of its nbTrans transmissions are: recover
+    //the loss of a single transmission from the one of the frames
+    double loss = std::pow (state.frameLoss, 1.0 / state.nbTrans);
+
+    uint8_t rep = 1;
+    double frameLoss = loss;
+    while(rep < maxRepetitions && frameLoss > targetFrameLoss)
+    {
+      rep++;
+      frameLoss *= loss;
+    }
+
+    return rep;
+  }
+
+  void AdrComponent::AddReception (DeviceState &state, bool newPacket,
+                                   double snr) const
+  {
+    //Keep the SNR of the newest packet in the history up to date with the
+    //one at each gateway
+    if(newPacket)
+    {
+      state.gwCount = 1;
+      state.snrSum = snr;
+      state.snrMax = snr;
+    }
+    else
+    {
+      state.gwCount++;
+      state.snrSum += snr;
+      if(snr > state.snrMax)
+        state.snrMax = snr;
+    }
+
+    if(tpAveraging == COMBINED_TX_POWER && newPacket)
+      state.snrCombined = snr;
+    else if(tpAveraging == COMBINED_TX_POWER)
+    {
+      double pair[2] = {state.snrCombined, snr};
+      state.snrCombined = AdrReducePowerSum (pair, 2);
+    }
+
+    if(tpAveraging == TOP_K_TX_POWER)
+    {
+      GatewaySelection selection = GetGatewaySelection (state.spreadingFactor);
+
+      if(newPacket)
+        state.topCount = 0;
+
+      //Receptions below the floor are ignored. Otherwise, once k are kept,
+      //replace the weakest of them if this one is stronger.
+      if(snr >= selection.floor && state.topCount < selection.k)
+        state.topSnr[state.topCount++] = snr;
+      else if(snr >= selection.floor)
+      {
+        double *weakest = std::min_element (state.topSnr,
+                                            state.topSnr + state.topCount);
+        if(snr > *weakest)
+          *weakest = snr;
+      }
+    }
+
+    double packetSnr = m_receptionsSnr (state);
+
+    if(historyAveraging == EWMA_SNR && newPacket)
+      state.snrEwma.Push (packetSnr, ewmaWeight);
+    else if(historyAveraging == EWMA_SNR)
+      state.snrEwma.UpdateNewest (packetSnr, ewmaWeight);
+    else if(newPacket)
+      state.snrHistory.Push (packetSnr);
+    else
+      state.snrHistory.UpdateNewest (packetSnr);
+  }
+
+  AdrComponent::DeviceState *
+  AdrComponent::FindDeviceState (Ptr<EndDeviceStatus> status)
+  {
+    return FindDeviceState (status->GetMac ()->GetDeviceAddress ().Get ());
+  }
+
+  AdrComponent::DeviceState *
+  AdrComponent::FindDeviceState (uint32_t deviceAddress)
+  {
+    std::unordered_map<uint32_t, uint32_t>::const_iterator it = m_deviceSlots.find (deviceAddress);
+
+    if(it == m_deviceSlots.end ())
+      return 0;
+
+    return &m_deviceStates[it->second];
+  }
+
+  AdrComponent::DeviceState &
+  AdrComponent::GetDeviceState (uint32_t deviceAddress)
+  {
+    std::pair<std::unordered_map<uint32_t, uint32_t>::iterator, bool> slot =
+      m_deviceSlots.insert (std::make_pair (deviceAddress, m_deviceStates.size ()));
+
+    if(slot.second)
+    {
+      SnrHistory history (GetHistoryCapacity (), AllocateHistoryStorage ());
+      m_deviceStates.push_back (DeviceState (deviceAddress, history));
+    }
+
+    return m_deviceStates[slot.first->second];
+  }
+
+  uint8_t AdrComponent::GetHistoryCapacity (void) const
+  {
+    //The EWMA policy does not use the SNR ring buffer
+    return historyAveraging == EWMA_SNR ? 1 : historyRange;
+  }
+
+  char *AdrComponent::AllocateHistoryStorage (void)
+  {
+    //Round the slot of each device up to whole cache lines
+    if(m_deviceStates.empty ())
+      m_historyStride = (SnrHistory::GetStorageSize (GetHistoryCapacity ()) + 63) / 64 * 64;
+
+    size_t slot = m_deviceStates.size () % historyBlockSize;
+    if(slot == 0)
+      m_historyBlocks.push_back (std::vector<char, AdrAlignedAllocator<char> >
+                                 (historyBlockSize * m_historyStride));
+
+    return &m_historyBlocks.back ()[slot * m_historyStride];
+  }
+
+  void AdrComponent::ClearDeviceStates (void)
+  {
+    m_deviceStates.clear ();
+    m_deviceSlots.clear ();
+    m_historyBlocks.clear ();
   }
 }
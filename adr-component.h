@@ -23,12 +23,122 @@
 
 #include "ns3/object.h"
 #include "ns3/log.h"
+#include "ns3/callback.h"
 #include "ns3/packet.h"
+#include "ns3/traced-callback.h"
+#include "ns3/nstime.h"
+#include "ns3/event-id.h"
 #include "ns3/network-status.h"
+#include "ns3/lora-frame-header.h"
 #include "ns3/network-controller-components.h"
+#include "ns3/adr-reduction.h"
+#include "ns3/adr-region.h"
+#include "ns3/adr-aligned-allocator.h"
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace ns3 {
 
+  /////////////////////////////////////
+  // Per-device received SNR history //
+  /////////////////////////////////////
+
+  //Fixed size ring buffer holding the SNR of the latest packets received
+  //from a device. A running sum and a monotonic queue of the older samples
+  //are kept alongside, so that both the average and the maximum of the
+  //window can be read in constant time.
+  //The newest sample is kept out of the max queue, since its value can
+  //still change while other gateways report the same packet.
+  //The samples and the queue live in storage provided by the owner, of
+  //GetStorageSize (capacity) bytes aligned to 8: the history does not own
+  //it, and its copies share it.
+  class SnrHistory
+  {
+    public:
+
+      SnrHistory (uint8_t capacity, char *storage);
+
+      static size_t GetStorageSize (uint8_t capacity);
+
+      //Empty the window
+      void Clear (void);
+
+      //Add the SNR of a newly received packet to the window
+      void Push (double snr);
+
+      //Replace the SNR of the newest packet in the window
+      void UpdateNewest (double snr);
+
+      //Number of packets currently in the window
+      uint8_t GetSize (void) const;
+
+      //Copy the samples in the window to snr, oldest first
+      void GetSamples (double *snr) const;
+
+      double GetAverage (void) const;
+
+      double GetMax (void) const;
+
+      //Bring the data used by the next Push to the cache
+      void Prefetch (void) const;
+
+    private:
+
+      double *m_samples;
+
+      //Monotonic (decreasing) queue of the sealed samples in the window,
+      //stored as a ring of sequence numbers and values
+      uint64_t *m_maxSeq;
+      double *m_maxValue;
+
+      uint8_t m_capacity;
+      uint64_t m_count;
+      double m_sum;
+      uint8_t m_maxHead;
+      uint8_t m_maxSize;
+  };
+
+  //Exponentially weighted moving average of the SNR of the packets
+  //received from a device, kept in constant memory. As in SnrHistory, the
+  //newest sample can still be updated while other gateways report it.
+  class SnrEwma
+  {
+    public:
+
+      SnrEwma ();
+
+      //Add the SNR of a newly received packet, with the given weight
+      void Push (double snr, double weight);
+
+      //Replace the SNR of the newest packet
+      void UpdateNewest (double snr, double weight);
+
+      //Number of packets averaged so far
+      uint64_t GetCount (void) const;
+
+      double GetEstimate (void) const;
+
+      //Estimate before the newest sample was added
+      double GetPrevious (void) const;
+
+      //Set the average to the one read with the getters above
+      void Restore (double previous, double estimate, uint64_t count);
+
+    private:
+
+      //Estimate before the newest sample was added
+      double m_previous;
+      double m_estimate;
+      uint64_t m_count;
+  };
+
   ////////////////////////////////////////
   // LinkAdrRequest commands management //
   ////////////////////////////////////////
@@ -39,6 +149,51 @@ namespace ns3 {
 
       static TypeId GetTypeId (void);
 
+      //TX power from gateways policy
+      enum TpAveragingPolicy
+      {
+        //Max TX power between all connected GW
+        MAX_TX_POWER = 0,
+        //Average TX power considering all connected GW
+        AVERAGE_TX_POWER = 1,
+        //Average TX power of the topKGateways strongest GW, ignoring the
+        //ones below the demodulation floor
+        TOP_K_TX_POWER = 2,
+        //Sum of the TX power of all connected GW in the linear domain, as
+        //maximal ratio combining of their receptions would give
+        COMBINED_TX_POWER = 3
+      };
+
+      //Received SNR history policy
+      enum HistoryAveragingPolicy
+      {
+        //Max SNR between the latest historyRange packets
+        MAX_SNR = 0,
+        //Average SNR between the latest historyRange packets
+        AVERAGE_SNR = 1,
+        //Exponentially weighted average of the SNR of all the packets,
+        //needing constant memory per device (always incremental)
+        EWMA_SNR = 2
+      };
+
+      //Source of the per-gateway SNR of a reception
+      enum SnrSource
+      {
+        //Derived from the received power, ignoring interference
+        DERIVED_SNR = 0,
+        //Measured by the gateway and carried by an AdrSnrTag, falling back
+        //to the derived one for receptions without the tag
+        MEASURED_SNR = 1
+      };
+
+      //Regional parameters profile
+      enum Region
+      {
+        EU868 = 0,
+        US915 = 1,
+        AS923 = 2
+      };
+
       //Constructor
       AdrComponent ();
       //Destructor
@@ -54,66 +209,859 @@ namespace ns3 {
       void OnFailedReply (Ptr<EndDeviceStatus> status,
                           Ptr<NetworkStatus> networkStatus);
 
+      //New settings computed for a device by EvaluateBatch, ReplayUplink or
+      //RequestDecision
+      struct AdrDecision
+      {
+        //False if the device has not enough history for the algorithm to
+        //work, in which case its current settings are returned
+        bool valid;
+        //Whether the new settings differ from the current ones
+        bool changed;
+        //Set by ReplayUplink only: whether a LinkAdrReq is sent, that is
+        //the settings or the NbTrans changed and MinCommandInterval did
+        //not hold the command back
+        bool command;
+        uint8_t dataRate;
+        uint8_t txPower;
+      };
+
+      //Record of an ADR decision, fired through the AdrDecision trace source
+      struct DecisionTrace
+      {
+        //Simulation time of the decision (ns)
+        int64_t time;
+        //SNR margin of the device history (dB)
+        float margin;
+        uint32_t deviceAddress;
+        uint8_t oldDataRate;
+        uint8_t newDataRate;
+        //Transmission powers (dBm)
+        uint8_t oldTxPower;
+        uint8_t newTxPower;
+      };
+
+      typedef void (* DecisionTracedCallback) (const DecisionTrace &decision);
+
+      //Run the ADR algorithm on a set of devices, without touching their
+      //reply. Useful to preview the effect of a change of the parameters
+      //over the whole network.
+      std::vector<AdrDecision>
+      EvaluateBatch (const std::vector<Ptr<EndDeviceStatus> > &devices);
+
+      //Apply steps of 3 dB of SNR margin to the settings of a device: the
+      //positive steps first lower the SF down to minSpreadingFactor, then
+      //the TP in 2 dB steps, the negative ones raise the TP. The TP stops
+      //once it reaches or crosses its limits. Computed in closed form,
+      //without data dependent loops.
+      static void ApplyAdrSteps (int steps,
+                                 int minSpreadingFactor,
+                                 int minTransmissionPower,
+                                 int maxTransmissionPower,
+                                 uint8_t *spreadingFactor,
+                                 double *transmissionPower);
+
+      //Bounds of the histograms of Statistics
+      static const int marginBuckets = 30;
+      static constexpr double minMargin = -20;
+      static constexpr double marginBucketWidth = 2;
+      static const int stepBuckets = 24;
+      static const int minSteps = -8;
+
+      //Counters of the decisions taken by BeforeSendingReply and
+      //ReplayUplink
+      struct Statistics
+      {
+        //ADR requests evaluated
+        uint64_t decisions;
+        //ADR requests skipped because of a short device history
+        uint64_t insufficientHistory;
+        //LinkAdrReq commands added to replies
+        uint64_t linkAdrReqs;
+        //Decisions leaving the device settings unchanged
+        uint64_t unchanged;
+        //Commands not sent because of minCommandInterval
+        uint64_t rateLimited;
+        //Commands deferred because of the downlink budget of the gateway
+        uint64_t budgetLimited;
+        //Requests answered with the cached decision at their deadline
+        uint64_t deadlineFallbacks;
+        //SNR margin (dB), in buckets of marginBucketWidth starting from
+        //minMargin. The first and last buckets include the values out of
+        //range.
+        uint64_t marginHistogram[marginBuckets];
+        //Steps of the decision (floor of margin / 3), starting from
+        //minSteps, with the same treatment at the ends
+        uint64_t stepHistogram[stepBuckets];
+
+        void Print (std::ostream &os) const;
+      };
+
+      //Counters are updated with relaxed atomic operations, so they can be
+      //read at any time, also while a parallel replay runs. The values of
+      //the threads are summed.
+      Statistics GetStatistics (void) const;
+      void ResetStatistics (void);
+
+      //Replay of recorded uplinks outside of the simulator, driven by
+      //AdrParallelReplay. Only the incremental history is supported. Once
+      //the devices are created with RegisterDevices, calls for different
+      //devices can run concurrently, since each one only touches the state
+      //of its own device.
+      void RegisterDevices (const std::vector<uint32_t> &deviceAddresses);
+
+      //Hint that an uplink of the device is going to be replayed soon, so
+      //that its state is brought to the cache in the meantime
+      void PrefetchDevice (uint32_t deviceAddress) const;
+
+      //Add an uplink received at time (s) to the history of the device,
+      //with the power (dBm) it was received with by each gateway, and
+      //return the decision taken on it (not valid if ADR was not
+      //requested). MinCommandInterval and MaxRepetitions are applied as in
+      //BeforeSendingReply, and the commands are counted in the statistics.
+      //The downlink budget is not: the uplinks do not tell which gateway
+      //would send the reply.
+      AdrDecision ReplayUplink (uint32_t deviceAddress,
+                                double time,
+                                uint8_t spreadingFactor,
+                                double transmissionPower,
+                                bool adrRequested,
+                                const double *rxPower,
+                                size_t nGateways);
+
+      //Write the per-device state (settings, SNR history, frame loss) to
+      //a binary snapshot, to warm start a later run with LoadSnapshot.
+      //The file is a header followed by one fixed size record per device,
+      //in native byte order, so that it is read in place. Return whether
+      //the file could be written.
+      bool SaveSnapshot (const std::string &path) const;
+
+      //Create or overwrite the state of the devices in a snapshot. The
+      //snapshot must have been taken with the same HistoryRange,
+      //TpAveraging and SnrSource, and with EWMA_SNR in use or not as now.
+      //Only the incremental history can be loaded. Return whether it was
+      //loaded.
+      bool LoadSnapshot (const std::string &path);
+
+      //Asynchronous decisions, for network servers keeping the history of
+      //the devices in an external store. Only the incremental history is
+      //supported, and the device must have been seen through
+      //OnReceivedPacket or ReplayUplink.
+      //
+      //RequestDecision asks the fetch callback for the SNR history of the
+      //device, tagging the request with an id. The store answers, possibly
+      //later, with DeliverHistory, which computes the decision on the
+      //fetched history and passes it to the completion callback. If the
+      //answer does not come within the deadline, the completion gets the
+      //latest decision cached for the device instead (not valid if there
+      //is none). Without a fetch callback, the decision is taken on the
+      //local history and completion is called before RequestDecision
+      //returns.
+      //
+      //The deadline is an event of the simulator: with the realtime
+      //simulator the store can answer from another thread by scheduling
+      //DeliverHistory through Simulator::ScheduleWithContext.
+      typedef Callback<void, uint64_t, uint32_t> HistoryFetchCallback;
+      typedef Callback<void, uint32_t, const AdrDecision &> DecisionCallback;
+
+      void SetHistoryFetchCallback (HistoryFetchCallback fetch);
+
+      void RequestDecision (uint32_t deviceAddress, Time deadline,
+                            DecisionCallback completion);
+
+      //Answer of the store to request requestId: the SNR of the latest
+      //packets of the device, oldest first. Late answers are ignored.
+      void DeliverHistory (uint64_t requestId, const std::vector<double> &snr);
+
     private:
 
+      //State the component keeps for each end device
+      struct DeviceState;
+
+      //Downlink budget of a gateway
+      struct GatewayBudget;
+
+      virtual void DoDispose (void);
+
+      //Reuse the latest decision of the device if still valid, run
+      //ComputeDecision otherwise. historySize is the one returned by
+      //GetHistorySize, computed once by the caller since in the scanning
+      //mode each call copies the packet list.
       void AdrImplementation(uint8_t *newDataRate,
                              uint8_t *newTxPower,
-                             Ptr<EndDeviceStatus> status);
+                             double *margin,
+                             uint8_t spreadingFactor,
+                             double transmissionPower,
+                             size_t historySize,
+                             Ptr<EndDeviceStatus> status,
+                             DeviceState *state) const;
+
+      //Run the algorithm and store the result in the state of the device
+      void ComputeDecision(uint8_t *newDataRate,
+                           uint8_t *newTxPower,
+                           double *margin,
+                           uint8_t spreadingFactor,
+                           double transmissionPower,
+                           size_t historySize,
+                           Ptr<EndDeviceStatus> status,
+                           DeviceState *state) const;
+
+      //Update the counters with a decision taken on an ADR request
+      void RecordDecision (double margin, bool changed);
+
+      //Periodic job of the precompute mode: compute the decision of every
+      //device from its current history, then schedule the next run
+      void PrecomputeDecisions (void);
+
+      //Core of the algorithm: compute the new settings of a device given
+      //the SNR of its history and its current settings. Returns the SNR
+      //margin (dB).
+      double ComputeAdrSettings(double m_SNR,
+                              uint8_t spreadingFactor,
+                              double transmissionPower,
+                              uint8_t *newDataRate,
+                              uint8_t *newTxPower) const;
+
+      //ComputeAdrSettings on arrays of n devices, given the demodulation
+      //floor of their SF, returning the new SF and TP of each. Used by
+      //EvaluateBatch.
+      void ComputeAdrSettingsBatch(size_t n,
+                                   const double *m_SNR,
+                                   const double *req_SNR,
+                                   const uint8_t *spreadingFactor,
+                                   const double *transmissionPower,
+                                   uint8_t *newSpreadingFactor,
+                                   double *newTransmissionPower) const;
+
+      //Number of packets of the device history available to the algorithm
+      size_t GetHistorySize (Ptr<EndDeviceStatus> status,
+                             const DeviceState *state) const;
+
+      //Capacity mode: among the SFs from minSpreadingFactor up, return the
+      //one with the least expected airtime per delivered frame, given the
+      //load measured on each SF
+      uint8_t SelectCapacitySpreadingFactor (uint8_t minSpreadingFactor) const;
+
+      //Account for the airtime of a new uplink in the load table
+      void UpdateLoad (uint8_t spreadingFactor, double frequency);
+
+      //Number of packets needed before the algorithm runs: historyRange,
+      //or warmUpSamples during the warm-up
+      size_t GetRequiredHistorySize (void) const;
+
+      //Extra SNR margin required from a device with the given number of
+      //packets, decreasing linearly to zero at historyRange
+      double GetHistoryWarmUpMargin (size_t historySize) const;
+
+      //Maximum or average SNR of the device history, based on
+      //historyAveraging
+      double GetHistorySNR (Ptr<EndDeviceStatus> status,
+                            const DeviceState *state) const;
+
+      //Versions of GetHistorySNR specialized for a given configuration:
+      //GetHistorySNR calls the one selected by SelectPolicies.
+      template <class HistoryPolicy>
+      double GetIncrementalHistorySNR (Ptr<EndDeviceStatus> status,
+                                       const DeviceState *state) const;
+
+      template <class TpPolicy, class HistoryPolicy>
+      double GetScannedHistorySNR (Ptr<EndDeviceStatus> status,
+                                   const DeviceState *state) const;
+
+      //std::floor and std::ceil of x to int, for x within the range of
+      //int. Unlike those, they vectorize without -fno-trapping-math.
+      static constexpr int FloorToInt (double x)
+      {
+        return int (x) - (x < int (x));
+      }
+
+      static constexpr int CeilToInt (double x)
+      {
+        return int (x) + (x > int (x));
+      }
+
+      //Index of the SF in the tables: SF 12 to 8 map to 0 to 4, any other
+      //value to 5
+      static constexpr uint8_t SfToIndex (uint8_t sf)
+      {
+        return (sf >= 8 && sf <= 12) ? 12 - sf : 5;
+      }
+
+      //Data rate of the SF in the region
+      uint8_t SfToDr (uint8_t sf) const
+      {
+        return m_region->dataRate[SfToIndex (sf)];
+      }
+
+      //The following conversion ignores interfering packets
+      static constexpr double TxPowerToSNR (double transmissionPower)
+      {
+        return transmissionPower - noiseFloor;
+      }
+
+      //Number of gateway powers reduced at once by the vectorized kernels
+      static const size_t gwChunkSize = 32;
+
+      static double GetMaxTxFromGateways (const EndDeviceStatus::GatewayList &gwList);
+
+      static double GetAverageTxFromGateways (const EndDeviceStatus::GatewayList &gwList);
+
+      static double GetCombinedTxFromGateways (const EndDeviceStatus::GatewayList &gwList);
+
+      //Parameters of the TOP_K_TX_POWER policy for a packet
+      struct GatewaySelection
+      {
+        //Number of gateways to average
+        uint8_t k;
+        //SNR (dB) below which the packet is not demodulated
+        double floor;
+      };
 
-      uint8_t SfToDr (uint8_t sf);
+      GatewaySelection GetGatewaySelection (uint8_t spreadingFactor) const;
 
-      double TxPowerToSNR (double transmissionPower);
+      static double GetTopKTxFromGateways (const EndDeviceStatus::GatewayList &gwList,
+                                           const GatewaySelection &selection);
 
-      double GetMaxTxFromGateways (EndDeviceStatus::GatewayList gwList);
+      //Upper limit of topKGateways
+      static const uint8_t maxTopKGateways = 8;
 
-      double GetAverageTxFromGateways (EndDeviceStatus::GatewayList gwList);
+      //TXPower index of the LinkAdrReq command: txPowerIndexZero maps to
+      //index 0 and every index lowers the power by 2 dB, down to
+      //maxTxPowerIndex
+      static constexpr int GetTxPowerIndex (const AdrRegionProfile &region,
+                                            int txPower)
+      {
+        return txPower >= region.txPowerIndexZero ? 0 :
+          ((region.txPowerIndexZero - txPower + 1) / 2 > region.maxTxPowerIndex ?
+           region.maxTxPowerIndex : (region.txPowerIndexZero - txPower + 1) / 2);
+      }
 
-      double GetReceivedPower (EndDeviceStatus::GatewayList gwList);
+      //Airtime (s) saved on every uplink of a device moving from the SF to
+      //the data rate, negative if the new data rate is slower
+      double GetAirtimeGain (uint8_t spreadingFactor, uint8_t dataRate) const;
 
-      double GetMaxSNR (EndDeviceStatus::ReceivedPacketList packetList,
-                        uint8_t historyRange);
+      //Take a LinkAdrReq from the downlink budget of the gateway serving
+      //the device. When less than half of the budget is left, only the
+      //commands saving more airtime than the average of the gateway, or
+      //restoring the link of the device (slower data rate or higher TX
+      //power), are admitted. The budget used is recorded in state, if
+      //given, so that OnFailedReply can give it back.
+      bool AdmitCommand (Ptr<NetworkStatus> networkStatus,
+                         LoraDeviceAddress deviceAddress, double gain,
+                         bool restoresLink, DeviceState *state);
 
-      double GetAverageSNR (EndDeviceStatus::ReceivedPacketList packetList,
-                            uint8_t historyRange);
+      //Read the frame header of an uplink packet
+      static LoraFrameHeader GetFrameHeader (Ptr<const Packet> packet);
 
-      int GetTxPowerIndex (int txPower);
+      //Read the ADR bit from the frame header of an uplink packet
+      static bool GetAdrBit (Ptr<const Packet> packet);
 
-      //TX power from gateways policy:
-      //0 - max TX power between all connected GW
-      //1 - average TX power considering all connected GW
-      const bool tpAveraging = 1;
+      //The fields read by a decision come first: the settings, the cached
+      //decision, the history and the EWMA take the first 152 bytes, within
+      //three cache lines. The per-packet accumulators used on reception,
+      //the frame loss and the state of the latest command follow, for 320
+      //bytes (five cache lines) in total.
+      //The samples of the history are stored apart, in m_historyBlocks.
+      struct alignas (64) DeviceState
+      {
+        //The history is emptied
+        DeviceState (uint32_t address, const SnrHistory &history);
+
+        //Uid of the latest packet received from the device
+        uint64_t lastPacketUid;
+
+        //Incremented on every reception from the device
+        uint64_t historyEpoch;
+
+        uint32_t deviceAddress;
+
+        //ADR bit of the latest packet received from the device
+        bool adrRequested;
+
+        //Settings of the device when it sent its latest packet
+        uint8_t spreadingFactor;
+        double transmissionPower;
+
+        //Latest decision taken for the device, together with the inputs it
+        //was taken on: it is reused as long as they do not change
+        struct
+        {
+          uint64_t historyEpoch;
+          uint32_t configEpoch;
+          uint8_t spreadingFactor;
+          double transmissionPower;
+          uint8_t dataRate;
+          uint8_t txPower;
+          double margin;
+        } cachedDecision;
+
+        SnrHistory snrHistory;
+        SnrEwma snrEwma;
+
+        //Time (s) of the latest LinkAdrReq sent to the device
+        double lastCommandTime;
+
+        //SNR of the latest packet at the gateways that reported it so far
+        uint8_t gwCount;
+        double snrSum;
+        double snrMax;
+
+        //Sum in the linear domain (dB), for the COMBINED_TX_POWER policy
+        double snrCombined;
+
+        //Strongest receptions above the demodulation floor, unsorted, for
+        //the TOP_K_TX_POWER policy
+        uint8_t topCount;
+        double topSnr[maxTopKGateways];
+
+        //Frame counter of the latest packet, and estimated fraction of the
+        //frames lost, from the gaps between the counters
+        uint16_t lastFCnt;
+        bool fCntValid;
+        double frameLoss;
+
+        //NbTrans of the latest LinkAdrReq sent to the device
+        uint8_t nbTrans;
+
+        //Whether a LinkAdrReq was added to the reply to the latest packet,
+        //and the values of lastCommandTime and nbTrans before it, restored
+        //by OnFailedReply if the reply is not sent
+        bool commandPending;
+        uint8_t previousNbTrans;
+        double previousCommandTime;
+
+        //Downlink budget the pending command was taken from (0 if none),
+        //and the change it made to the average gain of the gateway, given
+        //back by OnFailedReply. Only valid while commandBudgetEpoch equals
+        //m_budgetEpoch.
+        GatewayBudget *commandBudget;
+        double commandGainChange;
+        uint32_t commandBudgetEpoch;
+
+        void InvalidateCachedDecision (void);
+      };
+
+      //Layout of a snapshot file: the header is followed by nDevices
+      //records of recordSize bytes, each made of a SnapshotRecord followed
+      //by historyCapacity SNR samples (oldest first)
+      struct SnapshotHeader
+      {
+        uint32_t magic;
+        uint16_t version;
+        uint8_t historyCapacity;
+        //1 if the snapshot was taken with EWMA_SNR, whose history differs
+        uint8_t ewmaHistory;
+        uint32_t recordSize;
+        uint32_t nDevices;
+        //Policies the samples of the history were combined with
+        uint8_t tpAveraging;
+        uint8_t snrSource;
+        //Keeps the records at multiples of 8 bytes
+        uint8_t reserved[6];
+      };
+
+      struct SnapshotRecord
+      {
+        uint32_t deviceAddress;
+        uint16_t lastFCnt;
+        uint8_t fCntValid;
+        uint8_t nbTrans;
+        uint8_t adrRequested;
+        uint8_t spreadingFactor;
+        uint8_t historySize;
+        uint8_t reserved;
+        double transmissionPower;
+        double frameLoss;
+        double ewmaPrevious;
+        double ewmaEstimate;
+        uint64_t ewmaCount;
+      };
+
+      static const uint32_t snapshotMagic = 0x53524441; //"ADRS"
+      static const uint16_t snapshotVersion = 2;
+
+      //Decision of the device on its current state, as returned by
+      //ReplayUplink and RequestDecision
+      AdrDecision DecideOnState (DeviceState &state);
+
+      //Not valid decision, for requests on devices without a state
+      static AdrDecision GetUnknownDeviceDecision (void);
+
+      //Complete the request with the cached decision of the device
+      void OnDecisionDeadline (uint64_t requestId);
+
+      struct PendingRequest
+      {
+        uint32_t deviceAddress;
+        DecisionCallback completion;
+        EventId deadline;
+      };
+
+      HistoryFetchCallback m_historyFetch;
+      std::unordered_map<uint64_t, PendingRequest> m_pendingRequests;
+      uint64_t m_nextRequestId = 0;
+
+      //Capacity of the SNR history of the devices
+      uint8_t GetHistoryCapacity (void) const;
+
+      //Return the state of the device, or 0 if none of its packets was seen
+      DeviceState *FindDeviceState (Ptr<EndDeviceStatus> status);
+      DeviceState *FindDeviceState (uint32_t deviceAddress);
+
+      DeviceState &GetDeviceState (uint32_t deviceAddress);
+
+      //Update the frame loss estimate of the device with the counter of a
+      //new packet
+      void UpdateFrameLoss (DeviceState &state, uint16_t fCnt) const;
+
+      //Number of transmissions of each frame bringing the frame loss of
+      //the device down to targetFrameLoss, up to maxRepetitions
+      uint8_t GetRepetitions (const DeviceState &state) const;
+
+      //Record in the state of the device a LinkAdrReq sent at time now (s)
+      //with NbTrans rep, keeping the previous values for OnFailedReply
+      void RecordCommand (DeviceState &state, double now, uint8_t rep);
+
+      //Add the SNR of the packet at a gateway to the incremental history
+      void AddReception (DeviceState &state, bool newPacket,
+                         double snr) const;
+
+      void ClearDeviceStates (void);
+
+      //Storage for the SNR history of the next device
+      char *AllocateHistoryStorage (void);
+
+      //Dense table of the per-device states, indexed by a slot assigned to
+      //each device the first time one of its packets is seen
+      std::vector<DeviceState, AdrAlignedAllocator<DeviceState> > m_deviceStates;
+      std::unordered_map<uint32_t, uint32_t> m_deviceSlots;
+
+      //Storage of the SNR histories, one cache aligned slot per device, in
+      //blocks of historyBlockSize devices. Blocks are never moved, so that
+      //the states can point into them.
+      static const size_t historyBlockSize = 256;
+      std::deque<std::vector<char, AdrAlignedAllocator<char> > > m_historyBlocks;
+      size_t m_historyStride = 0;
+
+      //Max and average policies, used both for the power received by the
+      //gateways (tpAveraging) and for the SNR history (historyAveraging)
+      struct MaxPolicy
+      {
+        static double FromGateways (const EndDeviceStatus::GatewayList &gwList,
+                                    const GatewaySelection &selection)
+        {
+          return GetMaxTxFromGateways (gwList);
+        }
+
+        static double FromReceptions (const DeviceState &state)
+        {
+          return state.snrMax;
+        }
+
+        static double FromSamples (const double *snr, size_t n)
+        {
+          return AdrReduceMax (snr, n);
+        }
+
+        static double FromHistory (const DeviceState &state)
+        {
+          return state.snrHistory.GetMax ();
+        }
+      };
+
+      struct AveragePolicy
+      {
+        static double FromGateways (const EndDeviceStatus::GatewayList &gwList,
+                                    const GatewaySelection &selection)
+        {
+          return GetAverageTxFromGateways (gwList);
+        }
+
+        static double FromReceptions (const DeviceState &state)
+        {
+          return state.snrSum / state.gwCount;
+        }
+
+        static double FromSamples (const double *snr, size_t n)
+        {
+          return AdrReduceSum (snr, n) / n;
+        }
+
+        static double FromHistory (const DeviceState &state)
+        {
+          return state.snrHistory.GetAverage ();
+        }
+      };
+
+      struct TopKPolicy
+      {
+        static double FromGateways (const EndDeviceStatus::GatewayList &gwList,
+                                    const GatewaySelection &selection)
+        {
+          return GetTopKTxFromGateways (gwList, selection);
+        }
+
+        //If no gateway is above the floor, fall back to the strongest one
+        static double FromReceptions (const DeviceState &state)
+        {
+          if(state.topCount == 0)
+            return state.snrMax;
+
+          return AdrReduceSum (state.topSnr, state.topCount) / state.topCount;
+        }
+      };
+
+      struct CombinedPolicy
+      {
+        static double FromGateways (const EndDeviceStatus::GatewayList &gwList,
+                                    const GatewaySelection &selection)
+        {
+          return GetCombinedTxFromGateways (gwList);
+        }
+
+        static double FromReceptions (const DeviceState &state)
+        {
+          return state.snrCombined;
+        }
+      };
+
+      struct EwmaPolicy
+      {
+        static double FromHistory (const DeviceState &state)
+        {
+          return state.snrEwma.GetEstimate ();
+        }
+      };
+
+      //Select the specialized functions for the current configuration, so
+      //that the decision path does not need to branch on it. Called by the
+      //attribute setters, it also invalidates the cached decisions.
+      void SelectPolicies (void);
+
+      //Attribute setters
+      void SetTpAveraging (TpAveragingPolicy policy);
+      void SetHistoryRange (uint8_t range);
+      void SetTopKGateways (uint8_t k);
+      void SetHistoryAveraging (HistoryAveragingPolicy policy);
+      void SetIncrementalHistory (bool incremental);
+      void SetEwmaWeight (double weight);
+      void SetSnrSource (SnrSource source);
+      void SetRegion (Region region);
+      void SetMinSpreadingFactor (int sf);
+      void SetMinTransmissionPower (int txPower);
+      void SetMaxTransmissionPower (int txPower);
+      void SetOffset (int offset);
+      void SetWarmUpSamples (uint8_t samples);
+      void SetWarmUpMargin (double margin);
+      void SetAirtimeAware (bool airtimeAware);
+      void SetLoadWindow (Time window);
+      void SetPrecomputeInterval (Time interval);
+      void SetHysteresis (double hysteresis);
+      void SetMinCommandInterval (Time interval);
+      void SetDownlinkBudget (uint32_t budget);
+      void SetBudgetWindow (Time window);
+      void SetMaxRepetitions (uint8_t repetitions);
+      void SetTargetFrameLoss (double loss);
+
+      //Attribute getters
+      TpAveragingPolicy GetTpAveraging (void) const;
+      uint8_t GetHistoryRange (void) const;
+      uint8_t GetTopKGateways (void) const;
+      HistoryAveragingPolicy GetHistoryAveraging (void) const;
+      bool GetIncrementalHistory (void) const;
+      double GetEwmaWeight (void) const;
+      SnrSource GetSnrSource (void) const;
+      Region GetRegion (void) const;
+      int GetMinSpreadingFactor (void) const;
+      int GetMinTransmissionPower (void) const;
+      int GetMaxTransmissionPower (void) const;
+      int GetOffset (void) const;
+      uint8_t GetWarmUpSamples (void) const;
+      double GetWarmUpMargin (void) const;
+      bool GetAirtimeAware (void) const;
+      Time GetLoadWindow (void) const;
+      Time GetPrecomputeInterval (void) const;
+      double GetHysteresis (void) const;
+      Time GetMinCommandInterval (void) const;
+      uint32_t GetDownlinkBudget (void) const;
+      Time GetBudgetWindow (void) const;
+      uint8_t GetMaxRepetitions (void) const;
+      double GetTargetFrameLoss (void) const;
+
+      //Incremented on every change of the configuration, so that the
+      //decisions cached before it are not reused
+      uint32_t m_configEpoch = 0;
+
+      //Offered load (airtime per second) of each SF on each channel,
+      //decaying with time constant loadWindow. Channels are added in order
+      //of appearance, any beyond maxLoadChannels share the last slot.
+      static const uint8_t maxLoadChannels = 16;
+      double m_load[6][maxLoadChannels] = {};
+      double m_loadChannels[maxLoadChannels] = {};
+      uint8_t m_nLoadChannels = 0;
+      double m_loadUpdated = 0;
+
+      //Internal version of Statistics, one copy per slot on its own cache
+      //lines, so that threads updating the counters do not contend. Threads
+      //are assigned a slot in order of first use, modulo counterSlots.
+      static const unsigned counterSlots = 16;
+      struct alignas (64) Counters
+      {
+        std::atomic<uint64_t> decisions;
+        std::atomic<uint64_t> insufficientHistory;
+        std::atomic<uint64_t> linkAdrReqs;
+        std::atomic<uint64_t> unchanged;
+        std::atomic<uint64_t> rateLimited;
+        std::atomic<uint64_t> budgetLimited;
+        std::atomic<uint64_t> deadlineFallbacks;
+        std::atomic<uint64_t> marginHistogram[marginBuckets];
+        std::atomic<uint64_t> stepHistogram[stepBuckets];
+      };
+      std::vector<Counters, AdrAlignedAllocator<Counters> > m_counters;
+
+      //Slot of the calling thread
+      Counters &GetCounters (void);
+
+      //Trace source fired for every decision taken in BeforeSendingReply
+      TracedCallback<const DecisionTrace &> m_decisionTrace;
+
+      //Functions selected by SelectPolicies
+      double (*m_receptionsSnr) (const DeviceState &state);
+      double (AdrComponent::*m_historySnr) (Ptr<EndDeviceStatus> status,
+                                            const DeviceState *state) const;
+
+      //TX power from gateways policy
+      TpAveragingPolicy tpAveraging = AVERAGE_TX_POWER;
 
       //Number of previous packets to consider
-      const uint8_t historyRange = 20;
+      uint8_t historyRange = 20;
+
+      //Number of gateways averaged by the TOP_K_TX_POWER policy
+      uint8_t topKGateways = 3;
+
+      //Received SNR history policy
+      HistoryAveragingPolicy historyAveraging = AVERAGE_SNR;
+
+      //Received SNR history computation:
+      //0 - scan the latest historyRange packets of ReceivedPacketList at
+      //    every decision
+      //1 - keep a per-device SNR history updated on every reception
+      bool incrementalHistory = 1;
 
-      //Received SNR history policy:
-      //0 - max SNR between the latest historyRange packets
-      //1 - average SNR between the latest historyRange packets
-      const bool historyAveraging = 1;
+      //Whether the incremental history is in use, which is always the case
+      //with the EWMA_SNR policy and the MEASURED_SNR source
+      bool m_useIncrementalHistory = 1;
+
+      //Weight of the newest packet in the EWMA_SNR policy
+      double ewmaWeight = 0.1;
+
+      //Per-gateway SNR source of the incremental history
+      SnrSource snrSource = DERIVED_SNR;
+
+      //Regional parameters
+      Region region = EU868;
+      const AdrRegionProfile *m_region = &EU868_ADR_PROFILE;
+
+      //Mandatory channel indexes of the region, built once by
+      //SelectPolicies rather than for every LinkAdrReq. AddLinkAdrReq
+      //takes the list by value, so each command still copies it.
+      std::list<int> m_enabledChannels;
 
       //SF lower limit
-      const int min_spreadingFactor = 7;
+      int min_spreadingFactor = 7;
+
+      //Minimum transmission power (dBm)
+      int min_transmissionPower = 2;
 
-      //Minimum transmission power (dBm) (Europe)
-      const int min_transmissionPower = 2;
+      //Maximum transmission power (dBm)
+      int max_transmissionPower = 14;
 
-      //Maximum transmission power (dBm) (Europe)
-      const int max_transmissionPower = 14;
+      //Transmission power limits, clamped to the ones of the region
+      int m_minTransmissionPower = 2;
+      int m_maxTransmissionPower = 14;
 
       //Device specific SNR margin (dB)
-      const int offset = 10;
+      int offset = 10;
+
+      //Extra SNR margin (dB) needed to move a device out of its current
+      //settings, on either side of the [0, 3) dB band leaving it unchanged
+      double hysteresis = 0;
+
+      //Minimum time (s) between two LinkAdrReq sent to a device
+      double minCommandInterval = 0;
+
+      //LinkAdrReq each gateway can send per budgetWindow (0 - unlimited)
+      uint32_t downlinkBudget = 0;
+
+      //Window (s) of the downlink budget
+      double budgetWindow = 3600;
+
+      //Downlink budget of a gateway, as a token bucket refilled at
+      //downlinkBudget per budgetWindow
+      struct GatewayBudget
+      {
+        double tokens;
+        //Time (s) of the latest refill
+        double updated;
+        //Running average of the airtime gain of the commands
+        double averageGain;
+      };
+      std::map<Address, GatewayBudget> m_gatewayBudgets;
+
+      //Incremented when m_gatewayBudgets is cleared, so that the budgets
+      //recorded in the device states are no longer used
+      uint32_t m_budgetEpoch = 0;
+
+      //Upper limit of the NbTrans setting (1 - never repeat frames)
+      uint8_t maxRepetitions = 1;
+
+      //Frame loss the NbTrans setting aims for
+      double targetFrameLoss = 0.01;
+
+      //Frame gaps longer than this are taken as a reset of the counter of
+      //the device rather than as lost frames
+      static const uint16_t maxFCntGap = 16384;
+
+      //Packets needed for the first decisions of a device, with a larger
+      //margin than the full history (0 - wait for historyRange packets)
+      uint8_t warmUpSamples = 0;
+
+      //Extra SNR margin (dB) of a decision taken on warmUpSamples packets
+      double warmUpMargin = 5;
+
+      //ADR objective:
+      //0 - fastest data rate the link margin allows
+      //1 - data rate minimizing the expected airtime per delivered frame,
+      //    among the ones the link margin allows, given the network load
+      bool airtimeAware = 0;
+
+      //Time constant (s) of the load measured in the airtime aware mode
+      double loadWindow = 1800;
+
+      //Period of PrecomputeDecisions (0 - decide in BeforeSendingReply).
+      //When it is set, replies reuse the latest precomputed decision of the
+      //device even if packets were received after it.
+      Time precomputeInterval;
+      EventId m_precomputeEvent;
 
       //Bandwidth (Hz)
-      const int B = 125000;
+      static constexpr int B = 125000;
 
       //Noise Figure (dB)
-      const int NF = 6;
+      static constexpr int NF = 6;
+
+      //Thermal noise floor (dBm) for bandwidth B and noise figure NF:
+      //-174 + 10 * log10(B) + NF, with 10 * log10(125000) = 50.969...
+      static constexpr double noiseFloor = -174 + 50.96910013008056 + NF;
 
       //Vector containing the required SNR for the 6 allowed SF levels
-      //ranging from 7 to 12 (the SNR values are in dB).
-      double treshold[6] = {-20.0, -17.5, -15.0, -12.5, -10.0, -7.5};
+      //ranging from 12 to 7 (the SNR values are in dB), indexed by
+      //SfToIndex.
+      static constexpr double treshold[6] = {-20.0, -17.5, -15.0, -12.5, -10.0, -7.5};
 
-      int counter = 0;
+      //Airtime (s) of a 20 bytes uplink for SF 12 to 7, at 125 kHz with
+      //coding rate 4/5
+      static constexpr double airtime[6] = {1.3189, 0.7414, 0.3707, 0.1853, 0.1029, 0.0566};
 };
 }
 
@@ -0,0 +1,142 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#include "ns3/adr-parallel-replay.h"
+#include "ns3/log.h"
+
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+
+namespace ns3 {
+
+  NS_LOG_COMPONENT_DEFINE ("AdrParallelReplay");
+
+  AdrParallelReplay::AdrParallelReplay (Ptr<AdrComponent> adr) :
+    m_adr (adr)
+  {}
+
+  void AdrParallelReplay::AddUplink (uint32_t deviceAddress,
+                                     double time,
+                                     uint8_t spreadingFactor,
+                                     double transmissionPower,
+                                     bool adrRequested,
+                                     const std::vector<double> &rxPower)
+  {
+    NS_ASSERT_MSG (!rxPower.empty (), "An uplink needs at least one gateway");
+
+    Uplink uplink;
+    uplink.deviceAddress = deviceAddress;
+    uplink.time = time;
+    uplink.spreadingFactor = spreadingFactor;
+    uplink.adrRequested = adrRequested;
+    uplink.transmissionPower = transmissionPower;
+    uplink.firstGateway = m_rxPower.size ();
+    uplink.nGateways = rxPower.size ();
+
+    m_uplinks.push_back (uplink);
+    m_rxPower.insert (m_rxPower.end (), rxPower.begin (), rxPower.end ());
+  }
+
+  size_t AdrParallelReplay::GetNUplinks (void) const
+  {
+    return m_uplinks.size ();
+  }
+
+  std::vector<AdrComponent::AdrDecision>
+  AdrParallelReplay::Run (unsigned nThreads)
+  {
+    if(nThreads == 0)
+      nThreads = std::max (std::thread::hardware_concurrency (), 1u);
+
+    NS_LOG_FUNCTION (this << nThreads << m_uplinks.size ());
+
+    //Assign the devices to the shards in order of appearance
+    std::unordered_map<uint32_t, uint32_t> deviceShards;
+    std::vector<uint32_t> devices;
+    for(size_t i = 0; i < m_uplinks.size (); i++)
+    {
+      if(deviceShards.insert (std::make_pair (m_uplinks[i].deviceAddress, 0)).second)
+        devices.push_back (m_uplinks[i].deviceAddress);
+    }
+
+    size_t nShards = std::min (size_t (nThreads) * shardsPerThread, devices.size ());
+    for(size_t d = 0; d < devices.size (); d++)
+      deviceShards[devices[d]] = d % nShards;
+
+    std::vector<std::vector<uint32_t> > shards (nShards);
+    for(size_t i = 0; i < m_uplinks.size (); i++)
+      shards[deviceShards[m_uplinks[i].deviceAddress]].push_back (i);
+
+    //Hand out the largest shards first, leaving the small ones to fill the
+    //gaps at the end of the run
+    std::sort (shards.begin (), shards.end (),
+               [] (const std::vector<uint32_t> &a, const std::vector<uint32_t> &b)
+               { return a.size () > b.size (); });
+
+    //Create all the device states before the threads start
+    m_adr->RegisterDevices (devices);
+
+    std::vector<AdrComponent::AdrDecision> decisions (m_uplinks.size ());
+    std::atomic<size_t> nextShard (0);
+
+    std::vector<std::thread> threads;
+    for(unsigned t = 1; t < nThreads; t++)
+      threads.push_back (std::thread (&AdrParallelReplay::ReplayShards, this,
+                                      &shards, &nextShard, &decisions));
+
+    //The calling thread works as well
+    ReplayShards (&shards, &nextShard, &decisions);
+
+    for(size_t t = 0; t < threads.size (); t++)
+      threads[t].join ();
+
+    return decisions;
+  }
+
+  void AdrParallelReplay::ReplayShards (const std::vector<std::vector<uint32_t> > *shards,
+                                        std::atomic<size_t> *nextShard,
+                                        std::vector<AdrComponent::AdrDecision> *decisions) const
+  {
+    //Use the component through a plain pointer: Ptr reference counting is
+    //not thread safe
+    AdrComponent *adr = PeekPointer (m_adr);
+
+    size_t s;
+    while((s = nextShard->fetch_add (1, std::memory_order_relaxed)) < shards->size ())
+    {
+      const std::vector<uint32_t> &shard = (*shards)[s];
+
+      for(size_t i = 0; i < shard.size (); i++)
+      {
+        const Uplink &uplink = m_uplinks[shard[i]];
+
+        (*decisions)[shard[i]] =
+          adr->ReplayUplink (uplink.deviceAddress,
+                             uplink.time,
+                             uplink.spreadingFactor,
+                             uplink.transmissionPower,
+                             uplink.adrRequested,
+                             &m_rxPower[uplink.firstGateway],
+                             uplink.nGateways);
+      }
+    }
+  }
+}
@@ -0,0 +1,93 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#ifndef ADR_PARALLEL_REPLAY_H
+#define ADR_PARALLEL_REPLAY_H
+
+#include "ns3/ptr.h"
+#include "ns3/adr-component.h"
+
+#include <atomic>
+#include <vector>
+
+namespace ns3 {
+
+  /////////////////////////////////////////
+  // Parallel replay of recorded uplinks //
+  /////////////////////////////////////////
+
+  //Feeds a trace of recorded uplinks through an AdrComponent outside of the
+  //simulator, using several threads. The devices are split in shards, and
+  //the uplinks of a shard are replayed in order by a single thread. Each
+  //thread claims the next unclaimed shard when it is done with its own, so
+  //that uneven shards do not leave threads idle.
+  class AdrParallelReplay
+  {
+    public:
+
+      AdrParallelReplay (Ptr<AdrComponent> adr);
+
+      //Append an uplink received at time (s) to the trace, with the power
+      //(dBm) it was received with by each gateway. The uplinks of a device
+      //are replayed in the order they are added.
+      void AddUplink (uint32_t deviceAddress,
+                      double time,
+                      uint8_t spreadingFactor,
+                      double transmissionPower,
+                      bool adrRequested,
+                      const std::vector<double> &rxPower);
+
+      size_t GetNUplinks (void) const;
+
+      //Replay the trace with nThreads threads (0 - one per core) and return
+      //the decision taken after each uplink, in the order they were added.
+      //The component must not be used by anyone else in the meantime.
+      std::vector<AdrComponent::AdrDecision> Run (unsigned nThreads);
+
+    private:
+
+      struct Uplink
+      {
+        uint32_t deviceAddress;
+        double time;
+        uint8_t spreadingFactor;
+        bool adrRequested;
+        double transmissionPower;
+        //Range of m_rxPower holding the gateway receptions
+        uint32_t firstGateway;
+        uint32_t nGateways;
+      };
+
+      //Body of the worker threads: replay shards until none is left
+      void ReplayShards (const std::vector<std::vector<uint32_t> > *shards,
+                         std::atomic<size_t> *nextShard,
+                         std::vector<AdrComponent::AdrDecision> *decisions) const;
+
+      //Shards per thread, enough to balance devices with different numbers
+      //of uplinks
+      static const unsigned shardsPerThread = 8;
+
+      Ptr<AdrComponent> m_adr;
+      std::vector<Uplink> m_uplinks;
+      std::vector<double> m_rxPower;
+  };
+}
+
+#endif
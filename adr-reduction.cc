@@ -0,0 +1,345 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#include "ns3/adr-reduction.h"
+#include "ns3/assert.h"
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ADR_REDUCTION_AVX2
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define ADR_REDUCTION_NEON
+#include <arm_neon.h>
+#endif
+
+namespace ns3 {
+
+  typedef double (*ReductionKernel) (const double *values, size_t n);
+
+  //Conversion of the values in dB relative to the maximum to powers of 2,
+  //with 10 ^ (x / 10) = 2 ^ (x * log2 (10) / 10). Values are clamped at
+  //powerSumFloor dB.
+  static const double dbToLog2 = 0.33219280948873623;
+  static const double powerSumFloor = -100;
+
+  //Taylor coefficients of 2 ^ f = exp (f * ln 2) for f in [0, 1), up to
+  //degree 7, highest first
+  static const double exp2Coefficients[8] = {
+    1.5252733804059841e-05, 1.5403530393381610e-04, 1.3333558146428443e-03,
+    9.6181291076284772e-03, 5.5504108664821580e-02, 2.4022650695910071e-01,
+    6.9314718055994531e-01, 1.0
+  };
+
+  //2 ^ t for t in [powerSumFloor * dbToLog2, 0]: 2 ^ floor (t) is built in
+  //the exponent bits, 2 ^ (t - floor (t)) comes from the polynomial
+  static inline double Exp2Scalar (double t)
+  {
+    double k = std::floor (t);
+    double f = t - k;
+
+    double p = exp2Coefficients[0];
+    for(int c = 1; c < 8; c++)
+      p = p * f + exp2Coefficients[c];
+
+    uint64_t bits = uint64_t (int64_t (k) + 1023) << 52;
+    double scale;
+    std::memcpy (&scale, &bits, sizeof (scale));
+
+    return p * scale;
+  }
+
+  static double PowerSumScalar (const double *values, size_t n, double max)
+  {
+    double sum = 0;
+
+    for(size_t i = 0; i < n; i++)
+    {
+      double x = values[i] - max;
+      if(x < powerSumFloor)
+        x = powerSumFloor;
+      sum += Exp2Scalar (x * dbToLog2);
+    }
+
+    return sum;
+  }
+
+  static double SumScalar (const double *values, size_t n)
+  {
+    double sum = 0;
+
+    for(size_t i = 0; i < n; i++)
+      sum += values[i];
+
+    return sum;
+  }
+
+  static double MaxScalar (const double *values, size_t n)
+  {
+    double max = values[0];
+
+    for(size_t i = 1; i < n; i++)
+    {
+      if(values[i] > max)
+        max = values[i];
+    }
+
+    return max;
+  }
+
+#ifdef ADR_REDUCTION_AVX2
+  //Four lanes of Exp2Scalar
+  __attribute__ ((target ("avx2")))
+  static inline __m256d Exp2Avx2 (__m256d t)
+  {
+    __m256d k = _mm256_floor_pd (t);
+    __m256d f = _mm256_sub_pd (t, k);
+
+    __m256d p = _mm256_set1_pd (exp2Coefficients[0]);
+    for(int c = 1; c < 8; c++)
+      p = _mm256_add_pd (_mm256_mul_pd (p, f), _mm256_set1_pd (exp2Coefficients[c]));
+
+    //Adding 2^52 + 2^51 moves the integer k + 1023 to the low bits of the
+    //mantissa, from where it is shifted to the exponent
+    __m256d biased = _mm256_add_pd (k, _mm256_set1_pd (6755399441055744.0 + 1023));
+    __m256i bits = _mm256_slli_epi64 (_mm256_castpd_si256 (biased), 52);
+
+    return _mm256_mul_pd (p, _mm256_castsi256_pd (bits));
+  }
+
+  __attribute__ ((target ("avx2")))
+  static double PowerSumAvx2 (const double *values, size_t n, double max)
+  {
+    __m256d maxv = _mm256_set1_pd (max);
+    __m256d floor = _mm256_set1_pd (powerSumFloor);
+    __m256d scale = _mm256_set1_pd (dbToLog2);
+    __m256d acc = _mm256_setzero_pd ();
+
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+      __m256d x = _mm256_max_pd (_mm256_sub_pd (_mm256_loadu_pd (values + i), maxv), floor);
+      acc = _mm256_add_pd (acc, Exp2Avx2 (_mm256_mul_pd (x, scale)));
+    }
+
+    __m128d sum2 = _mm_add_pd (_mm256_castpd256_pd128 (acc),
+                               _mm256_extractf128_pd (acc, 1));
+    double sum = _mm_cvtsd_f64 (_mm_add_sd (sum2, _mm_unpackhi_pd (sum2, sum2)));
+
+    //The compiler does not clear the upper halves before calling the
+    //scalar code, which would then pay a transition penalty
+    _mm256_zeroupper ();
+
+    return sum + PowerSumScalar (values + i, n - i, max);
+  }
+
+  __attribute__ ((target ("avx2")))
+  static double SumAvx2 (const double *values, size_t n)
+  {
+    //Two independent accumulators to hide the latency of the additions
+    __m256d acc0 = _mm256_setzero_pd ();
+    __m256d acc1 = _mm256_setzero_pd ();
+
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+      acc0 = _mm256_add_pd (acc0, _mm256_loadu_pd (values + i));
+      acc1 = _mm256_add_pd (acc1, _mm256_loadu_pd (values + i + 4));
+    }
+    acc0 = _mm256_add_pd (acc0, acc1);
+    for(; i + 4 <= n; i += 4)
+      acc0 = _mm256_add_pd (acc0, _mm256_loadu_pd (values + i));
+
+    __m128d sum2 = _mm_add_pd (_mm256_castpd256_pd128 (acc0),
+                               _mm256_extractf128_pd (acc0, 1));
+    double sum = _mm_cvtsd_f64 (_mm_add_sd (sum2, _mm_unpackhi_pd (sum2, sum2)));
+
+    for(; i < n; i++)
+      sum += values[i];
+
+    return sum;
+  }
+
+  __attribute__ ((target ("avx2")))
+  static double MaxAvx2 (const double *values, size_t n)
+  {
+    if(n < 4)
+      return MaxScalar (values, n);
+
+    __m256d acc = _mm256_loadu_pd (values);
+
+    size_t i = 4;
+    for(; i + 4 <= n; i += 4)
+      acc = _mm256_max_pd (acc, _mm256_loadu_pd (values + i));
+
+    __m128d max2 = _mm_max_pd (_mm256_castpd256_pd128 (acc),
+                               _mm256_extractf128_pd (acc, 1));
+    double max = _mm_cvtsd_f64 (_mm_max_sd (max2, _mm_unpackhi_pd (max2, max2)));
+
+    for(; i < n; i++)
+    {
+      if(values[i] > max)
+        max = values[i];
+    }
+
+    return max;
+  }
+#endif
+
+#ifdef ADR_REDUCTION_NEON
+  //Two lanes of Exp2Scalar
+  static inline float64x2_t Exp2Neon (float64x2_t t)
+  {
+    float64x2_t k = vrndmq_f64 (t);
+    float64x2_t f = vsubq_f64 (t, k);
+
+    float64x2_t p = vdupq_n_f64 (exp2Coefficients[0]);
+    for(int c = 1; c < 8; c++)
+      p = vaddq_f64 (vmulq_f64 (p, f), vdupq_n_f64 (exp2Coefficients[c]));
+
+    int64x2_t bits = vshlq_n_s64 (vaddq_s64 (vcvtq_s64_f64 (k), vdupq_n_s64 (1023)), 52);
+
+    return vmulq_f64 (p, vreinterpretq_f64_s64 (bits));
+  }
+
+  static double PowerSumNeon (const double *values, size_t n, double max)
+  {
+    float64x2_t maxv = vdupq_n_f64 (max);
+    float64x2_t floor = vdupq_n_f64 (powerSumFloor);
+    float64x2_t acc = vdupq_n_f64 (0);
+
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2)
+    {
+      float64x2_t x = vmaxq_f64 (vsubq_f64 (vld1q_f64 (values + i), maxv), floor);
+      acc = vaddq_f64 (acc, Exp2Neon (vmulq_n_f64 (x, dbToLog2)));
+    }
+
+    return vaddvq_f64 (acc) + PowerSumScalar (values + i, n - i, max);
+  }
+
+  static double SumNeon (const double *values, size_t n)
+  {
+    float64x2_t acc0 = vdupq_n_f64 (0);
+    float64x2_t acc1 = vdupq_n_f64 (0);
+
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+      acc0 = vaddq_f64 (acc0, vld1q_f64 (values + i));
+      acc1 = vaddq_f64 (acc1, vld1q_f64 (values + i + 2));
+    }
+    double sum = vaddvq_f64 (vaddq_f64 (acc0, acc1));
+
+    for(; i < n; i++)
+      sum += values[i];
+
+    return sum;
+  }
+
+  static double MaxNeon (const double *values, size_t n)
+  {
+    if(n < 2)
+      return MaxScalar (values, n);
+
+    float64x2_t acc = vld1q_f64 (values);
+
+    size_t i = 2;
+    for(; i + 2 <= n; i += 2)
+      acc = vmaxq_f64 (acc, vld1q_f64 (values + i));
+    double max = vmaxvq_f64 (acc);
+
+    for(; i < n; i++)
+    {
+      if(values[i] > max)
+        max = values[i];
+    }
+
+    return max;
+  }
+#endif
+
+  static ReductionKernel SelectSumKernel (void)
+  {
+#if defined(ADR_REDUCTION_AVX2)
+    if(__builtin_cpu_supports ("avx2"))
+      return SumAvx2;
+#elif defined(ADR_REDUCTION_NEON)
+    return SumNeon;
+#endif
+    return SumScalar;
+  }
+
+  static ReductionKernel SelectMaxKernel (void)
+  {
+#if defined(ADR_REDUCTION_AVX2)
+    if(__builtin_cpu_supports ("avx2"))
+      return MaxAvx2;
+#elif defined(ADR_REDUCTION_NEON)
+    return MaxNeon;
+#endif
+    return MaxScalar;
+  }
+
+  typedef double (*PowerSumKernel) (const double *values, size_t n, double max);
+
+  static PowerSumKernel SelectPowerSumKernel (void)
+  {
+#if defined(ADR_REDUCTION_AVX2)
+    if(__builtin_cpu_supports ("avx2"))
+      return PowerSumAvx2;
+#elif defined(ADR_REDUCTION_NEON)
+    return PowerSumNeon;
+#endif
+    return PowerSumScalar;
+  }
+
+  double AdrReduceSum (const double *values, size_t n)
+  {
+    static const ReductionKernel kernel = SelectSumKernel ();
+
+    return kernel (values, n);
+  }
+
+  double AdrReduceMax (const double *values, size_t n)
+  {
+    NS_ASSERT (n > 0);
+
+    static const ReductionKernel kernel = SelectMaxKernel ();
+
+    return kernel (values, n);
+  }
+
+  double AdrReducePowerSum (const double *values, size_t n)
+  {
+    NS_ASSERT (n > 0);
+
+    static const PowerSumKernel kernel = SelectPowerSumKernel ();
+
+    //Relative to the maximum the powers are at most 1, and the sum cannot
+    //overflow. Only one logarithm is taken, for the whole sum.
+    double max = AdrReduceMax (values, n);
+
+    return max + 10 * std::log10 (kernel (values, n, max));
+  }
+}
@@ -0,0 +1,52 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#ifndef ADR_REDUCTION_H
+#define ADR_REDUCTION_H
+
+#include <stddef.h>
+
+namespace ns3 {
+
+  ///////////////////////////////////
+  // Reductions over SNR and power //
+  ///////////////////////////////////
+
+  //Sum and maximum of an array of values, used by the ADR algorithm over
+  //the SNR history and over the gateways that received a packet.
+  //A vectorized kernel (AVX2 on x86, NEON on AArch64) is used when the
+  //machine supports it, the scalar one otherwise. On x86 the choice is made
+  //at run time, the first time each reduction is called.
+
+  //Sum of the n values (0 if n is 0)
+  double AdrReduceSum (const double *values, size_t n);
+
+  //Maximum of the n values (n must be positive)
+  double AdrReduceMax (const double *values, size_t n);
+
+  //Sum in the linear domain of n values in dB, returned in dB: that is
+  //10 * log10 (sum of 10 ^ (values / 10)), n must be positive. The powers
+  //are computed with a polynomial approximation, of relative error below
+  //2e-6 (1e-5 dB), and the values more than 100 dB below the maximum are
+  //left out.
+  double AdrReducePowerSum (const double *values, size_t n);
+}
+
+#endif
@@ -0,0 +1,71 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#ifndef ADR_REGION_H
+#define ADR_REGION_H
+
+#include <stdint.h>
+
+namespace ns3 {
+
+  //////////////////////////////////
+  // Regional parameters profiles //
+  //////////////////////////////////
+
+  //Regional parameters used by the ADR algorithm, from the LoRaWAN
+  //Regional Parameters specification. Only the 125 kHz data rates are
+  //considered.
+  struct AdrRegionProfile
+  {
+    //Limits of the transmission power of the devices (dBm)
+    int minTransmissionPower;
+    int maxTransmissionPower;
+
+    //Transmission power (dBm) of TXPower index 0 of the LinkAdrReq
+    //command: every following index lowers it by 2 dB, up to
+    //maxTxPowerIndex
+    int txPowerIndexZero;
+    uint8_t maxTxPowerIndex;
+
+    //Data rate of SF 12 down to SF 7. SFs not available in the region map
+    //to its most robust data rate.
+    uint8_t dataRate[6];
+
+    //Highest SF available for uplinks
+    uint8_t maxSpreadingFactor;
+
+    //Channels enabled by the LinkAdrReq command, numbered from 1 as in
+    //the list passed to LoraFrameHeader::AddLinkAdrReq
+    int channels[8];
+    uint8_t nChannels;
+  };
+
+  constexpr AdrRegionProfile EU868_ADR_PROFILE =
+    {2, 16, 16, 7, {0, 1, 2, 3, 4, 5}, 12, {1, 2, 3}, 3};
+
+  //The channels are the first sub-band of eight 125 kHz channels
+  constexpr AdrRegionProfile US915_ADR_PROFILE =
+    {2, 30, 30, 14, {0, 0, 0, 1, 2, 3}, 10, {1, 2, 3, 4, 5, 6, 7, 8}, 8};
+
+  constexpr AdrRegionProfile AS923_ADR_PROFILE =
+    {2, 16, 16, 7, {0, 1, 2, 3, 4, 5}, 12, {1, 2}, 2};
+}
+
+#endif
@@ -0,0 +1,331 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+/*
+ * Scalability scenario of the AdrComponent.
+ *
+ * A network server side simulation: every end device sends a periodic
+ * uplink requesting ADR, received by a number of gateways, and the network
+ * server side of the exchange is run through the simulator as in the
+ * lorawan module. Each uplink is inserted in the status of the device and
+ * reported to the component once per gateway, and BeforeSendingReply is
+ * called right after it. Devices send HistoryRange + 10 uplinks each, so
+ * that the histories fill up and decisions are taken.
+ *
+ * Each configuration is run in a child process, and the program reports
+ * for it the wall time of the simulation, the peak resident memory and the
+ * time spent inside the component, both with the incremental history and
+ * with the scan of the packet list of the devices.
+ *
+ * By default the number of devices, the history length and the number of
+ * gateways are swept one at a time around the baseline given by the
+ * options. With --sweep=false only the baseline is run.
+ *
+ * Usage: adr-scalability --devices=10000 --history=20 --gateways=8
+ *                        --period=600 --sweep=true
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/adr-component.h"
+#include "ns3/end-device-status.h"
+#include "ns3/end-device-lora-mac.h"
+#include "ns3/network-status.h"
+#include "ns3/lora-frame-header.h"
+#include "ns3/lora-mac-header.h"
+#include "ns3/lora-tag.h"
+#include "ns3/mac48-address.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("AdrScalability");
+
+struct ScenarioConfig
+{
+  uint32_t nDevices;
+  uint32_t history;
+  uint32_t nGateways;
+  bool incremental;
+  double period;      //Time between two uplinks of a device (s)
+};
+
+struct ScenarioResult
+{
+  double wallTime;    //Wall time of the simulation (s)
+  double adrTime;     //Wall time spent inside the component (s)
+  long peakRss;       //Peak resident memory of the process (kB)
+  uint64_t uplinks;
+  uint64_t linkAdrReqs;
+};
+
+class ScalabilityScenario
+{
+public:
+  ScalabilityScenario (const ScenarioConfig &config);
+
+  ScenarioResult Run (void);
+
+private:
+  void SendUplink (uint32_t device);
+
+  //Path loss (dB) of the link between a device and a gateway, fixed over
+  //the simulation
+  double GetPathLoss (uint32_t device, uint32_t gateway) const;
+
+  ScenarioConfig m_config;
+  Ptr<AdrComponent> m_adr;
+  Ptr<NetworkStatus> m_networkStatus;
+  Ptr<UniformRandomVariable> m_rng;
+  std::vector<Address> m_gateways;
+  std::vector<Ptr<EndDeviceStatus> > m_devices;
+  std::vector<uint8_t> m_spreadingFactor;
+  std::vector<uint16_t> m_fCnt;
+  uint32_t m_nPackets;
+  std::chrono::steady_clock::duration m_adrTime;
+  uint64_t m_uplinks;
+};
+
+ScalabilityScenario::ScalabilityScenario (const ScenarioConfig &config)
+  : m_config (config),
+    m_nPackets (config.history + 10),
+    m_adrTime (0),
+    m_uplinks (0)
+{
+  m_adr = CreateObject<AdrComponent> ();
+  m_adr->SetAttribute ("IncrementalHistory", BooleanValue (config.incremental));
+  m_adr->SetAttribute ("HistoryRange", UintegerValue (config.history));
+
+  m_networkStatus = CreateObject<NetworkStatus> ();
+  m_rng = CreateObject<UniformRandomVariable> ();
+
+  for (uint32_t g = 0; g < config.nGateways; g++)
+    {
+      m_gateways.push_back (Mac48Address::Allocate ());
+    }
+
+  m_spreadingFactor.resize (config.nDevices);
+  m_fCnt.resize (config.nDevices, 0);
+  for (uint32_t d = 0; d < config.nDevices; d++)
+    {
+      Ptr<EndDeviceLoraMac> mac = CreateObject<EndDeviceLoraMac> ();
+      mac->SetDeviceAddress (LoraDeviceAddress (d));
+      m_devices.push_back (CreateObject<EndDeviceStatus> (LoraDeviceAddress (d), mac));
+      m_spreadingFactor[d] = m_rng->GetInteger (7, 12);
+
+      //Spread the first uplinks over one period
+      Simulator::Schedule (Seconds (m_rng->GetValue (0, config.period)),
+                           &ScalabilityScenario::SendUplink, this, d);
+    }
+}
+
+double
+ScalabilityScenario::GetPathLoss (uint32_t device, uint32_t gateway) const
+{
+  //Hash of the pair, so that no per-link table is needed
+  uint32_t h = device * 2654435761u ^ (gateway + 1) * 2246822519u;
+  h ^= h >> 15;
+  h *= 2654435761u;
+  h ^= h >> 13;
+  return 90 + 50 * double (h % 10000) / 10000;
+}
+
+void
+ScalabilityScenario::SendUplink (uint32_t device)
+{
+  Ptr<EndDeviceStatus> status = m_devices[device];
+
+  Ptr<Packet> packet = Create<Packet> (10);
+
+  LoraFrameHeader fHdr;
+  fHdr.SetAsUplink ();
+  fHdr.SetAddress (LoraDeviceAddress (device));
+  fHdr.SetAdr (true);
+  fHdr.SetFCnt (m_fCnt[device]);
+  packet->AddHeader (fHdr);
+
+  LoraMacHeader mHdr;
+  mHdr.SetMType (LoraMacHeader::UNCONFIRMED_DATA_UP);
+  packet->AddHeader (mHdr);
+
+  //Report the packet once per gateway, as the network server does
+  for (uint32_t g = 0; g < m_config.nGateways; g++)
+    {
+      Ptr<Packet> copy = packet->Copy ();
+      LoraTag tag;
+      tag.SetSpreadingFactor (m_spreadingFactor[device]);
+      tag.SetReceivePower (14 - GetPathLoss (device, g) - m_rng->GetValue (0, 10));
+      copy->AddPacketTag (tag);
+
+      status->InsertReceivedPacket (copy, m_gateways[g]);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+      m_adr->OnReceivedPacket (copy, status, m_networkStatus);
+      m_adrTime += std::chrono::steady_clock::now () - start;
+    }
+
+  status->InitializeReply ();
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+  m_adr->BeforeSendingReply (status, m_networkStatus);
+  m_adrTime += std::chrono::steady_clock::now () - start;
+
+  m_uplinks++;
+  if (++m_fCnt[device] < m_nPackets)
+    {
+      Simulator::Schedule (Seconds (m_config.period),
+                           &ScalabilityScenario::SendUplink, this, device);
+    }
+}
+
+ScenarioResult
+ScalabilityScenario::Run (void)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+  Simulator::Run ();
+  std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now ();
+
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+
+  ScenarioResult result;
+  result.wallTime = std::chrono::duration<double> (stop - start).count ();
+  result.adrTime = std::chrono::duration<double> (m_adrTime).count ();
+  result.peakRss = usage.ru_maxrss;
+  result.uplinks = m_uplinks;
+  result.linkAdrReqs = m_adr->GetStatistics ().linkAdrReqs;
+
+  Simulator::Destroy ();
+  return result;
+}
+
+//Run the configuration in a child process, so that the peak memory of
+//each one is measured on its own, and print its results
+static void
+RunScenario (const ScenarioConfig &config)
+{
+  std::cout.flush ();
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      NS_FATAL_ERROR ("Cannot fork");
+    }
+
+  if (pid == 0)
+    {
+      ScenarioResult result = ScalabilityScenario (config).Run ();
+
+      std::cout << std::setw (10) << config.nDevices
+                << std::setw (10) << config.history
+                << std::setw (10) << config.nGateways
+                << std::setw (13) << (config.incremental ? "yes" : "no")
+                << std::fixed << std::setprecision (2)
+                << std::setw (12) << result.wallTime
+                << std::setw (12) << result.adrTime
+                << std::setw (8) << std::setprecision (1)
+                << 100 * result.adrTime / result.wallTime << "%"
+                << std::setw (14) << result.peakRss / 1024
+                << std::setw (14) << result.uplinks
+                << std::setw (12) << result.linkAdrReqs << std::endl;
+      _exit (0);
+    }
+
+  int childStatus;
+  waitpid (pid, &childStatus, 0);
+  if (!WIFEXITED (childStatus) || WEXITSTATUS (childStatus) != 0)
+    {
+      std::cout << "configuration devices=" << config.nDevices
+                << " history=" << config.history
+                << " gateways=" << config.nGateways
+                << " failed" << std::endl;
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  ScenarioConfig baseline;
+  baseline.nDevices = 10000;
+  baseline.history = 20;
+  baseline.nGateways = 8;
+  baseline.incremental = true;
+  baseline.period = 600;
+  bool sweep = true;
+
+  CommandLine cmd;
+  cmd.AddValue ("devices", "Number of end devices", baseline.nDevices);
+  cmd.AddValue ("history", "HistoryRange of the component", baseline.history);
+  cmd.AddValue ("gateways", "Number of gateways receiving each uplink", baseline.nGateways);
+  cmd.AddValue ("period", "Time between two uplinks of a device (s)", baseline.period);
+  cmd.AddValue ("sweep", "Whether to sweep each parameter around the others", sweep);
+  cmd.Parse (argc, argv);
+
+  std::vector<ScenarioConfig> configs;
+  configs.push_back (baseline);
+
+  if (sweep)
+    {
+      const uint32_t devices[] = {1000, 50000, 100000, 500000};
+      const uint32_t histories[] = {5, 50, 100};
+      const uint32_t gateways[] = {1, 20, 50};
+
+      for (size_t i = 0; i < sizeof (devices) / sizeof (devices[0]); i++)
+        {
+          configs.push_back (baseline);
+          configs.back ().nDevices = devices[i];
+        }
+      for (size_t i = 0; i < sizeof (histories) / sizeof (histories[0]); i++)
+        {
+          configs.push_back (baseline);
+          configs.back ().history = histories[i];
+        }
+      for (size_t i = 0; i < sizeof (gateways) / sizeof (gateways[0]); i++)
+        {
+          configs.push_back (baseline);
+          configs.back ().nGateways = gateways[i];
+        }
+    }
+
+  std::cout << std::setw (10) << "devices" << std::setw (10) << "history"
+            << std::setw (10) << "gateways" << std::setw (13) << "incremental"
+            << std::setw (12) << "wall (s)" << std::setw (12) << "adr (s)"
+            << std::setw (9) << "adr %" << std::setw (14) << "peak RSS (MB)"
+            << std::setw (14) << "uplinks" << std::setw (12) << "commands"
+            << std::endl;
+
+  for (size_t i = 0; i < configs.size (); i++)
+    {
+      for (int incremental = 1; incremental >= 0; incremental--)
+        {
+          configs[i].incremental = incremental;
+          RunScenario (configs[i]);
+        }
+    }
+
+  return 0;
+}
@@ -0,0 +1,76 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#include "ns3/adr-snr-tag.h"
+
+namespace ns3 {
+
+  NS_OBJECT_ENSURE_REGISTERED (AdrSnrTag);
+
+  TypeId AdrSnrTag::GetTypeId (void)
+  {
+    static TypeId tid = TypeId ("ns3::AdrSnrTag")
+    .SetParent<Tag> ()
+    .SetGroupName ("lorawan")
+    .AddConstructor<AdrSnrTag> ();
+    return tid;
+  }
+
+  TypeId AdrSnrTag::GetInstanceTypeId (void) const
+  {
+    return GetTypeId ();
+  }
+
+  AdrSnrTag::AdrSnrTag (double snr) :
+    m_snr (snr)
+  {}
+
+  AdrSnrTag::~AdrSnrTag () {}
+
+  uint32_t AdrSnrTag::GetSerializedSize (void) const
+  {
+    return sizeof (double);
+  }
+
+  void AdrSnrTag::Serialize (TagBuffer i) const
+  {
+    i.WriteDouble (m_snr);
+  }
+
+  void AdrSnrTag::Deserialize (TagBuffer i)
+  {
+    m_snr = i.ReadDouble ();
+  }
+
+  void AdrSnrTag::Print (std::ostream &os) const
+  {
+    os << m_snr;
+  }
+
+  double AdrSnrTag::GetSnr (void) const
+  {
+    return m_snr;
+  }
+
+  void AdrSnrTag::SetSnr (double snr)
+  {
+    m_snr = snr;
+  }
+}
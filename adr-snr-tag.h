@@ -0,0 +1,57 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+#ifndef ADR_SNR_TAG_H
+#define ADR_SNR_TAG_H
+
+#include "ns3/tag.h"
+
+namespace ns3 {
+
+  //Tag carrying the SNR measured by the gateway that received a packet.
+  //When present on the copies of an uplink passed to the AdrComponent, and
+  //the SnrSource attribute is set to Measured, this value is used instead
+  //of the one derived from the received power.
+  class AdrSnrTag : public Tag
+  {
+    public:
+
+      static TypeId GetTypeId (void);
+      virtual TypeId GetInstanceTypeId (void) const;
+
+      AdrSnrTag (double snr = 0);
+      virtual ~AdrSnrTag ();
+
+      virtual void Serialize (TagBuffer i) const;
+      virtual void Deserialize (TagBuffer i);
+      virtual uint32_t GetSerializedSize () const;
+      virtual void Print (std::ostream &os) const;
+
+      //SNR (dB) of the packet at the gateway
+      double GetSnr (void) const;
+      void SetSnr (double snr);
+
+    private:
+
+      double m_snr;
+  };
+}
+
+#endif
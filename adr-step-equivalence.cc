@@ -0,0 +1,139 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+/*
+ * Randomized equivalence check of AdrComponent::ApplyAdrSteps.
+ *
+ * The closed form computation of the new SF and TP is compared with the
+ * three while loops it replaced, kept here as the reference, on random
+ * steps, settings and limits. The limits are drawn around those of the
+ * regional profiles, and part of the powers are fractional. The program
+ * prints the first mismatches and exits with a non-zero status if there
+ * is any.
+ *
+ * Usage: adr-step-equivalence --cases=10000000 --seed=1
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/adr-component.h"
+
+#include <cmath>
+#include <iostream>
+#include <random>
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("AdrStepEquivalence");
+
+//The loops of ComputeAdrSettings before the closed form
+static void
+ApplyAdrStepsReference (int steps, int minSpreadingFactor,
+                        int minTransmissionPower, int maxTransmissionPower,
+                        uint8_t *spreadingFactor, double *transmissionPower)
+{
+  while (steps > 0 && *spreadingFactor > minSpreadingFactor)
+    {
+      (*spreadingFactor)--;
+      steps--;
+    }
+  while (steps > 0 && *transmissionPower > minTransmissionPower)
+    {
+      *transmissionPower -= 2;
+      steps--;
+    }
+  while (steps < 0 && *transmissionPower < maxTransmissionPower)
+    {
+      *transmissionPower += 2;
+      steps++;
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint64_t nCases = 10000000;
+  uint32_t seed = 1;
+
+  CommandLine cmd;
+  cmd.AddValue ("cases", "Number of random cases to compare", nCases);
+  cmd.AddValue ("seed", "Seed of the random cases", seed);
+  cmd.Parse (argc, argv);
+
+  std::mt19937 rng (seed);
+  std::uniform_int_distribution<int> stepsDist (-20, 20);
+  std::uniform_int_distribution<int> sfDist (7, 12);
+  std::uniform_int_distribution<int> minTpDist (0, 4);
+  std::uniform_int_distribution<int> maxTpDist (10, 30);
+  std::uniform_int_distribution<int> tpDist (-2, 32);
+  std::uniform_int_distribution<int> fractionDist (0, 3);
+
+  uint64_t mismatches = 0;
+  for (uint64_t i = 0; i < nCases; i++)
+    {
+      int steps = stepsDist (rng);
+      int minSpreadingFactor = sfDist (rng);
+      int minTransmissionPower = minTpDist (rng);
+      int maxTransmissionPower = maxTpDist (rng);
+      uint8_t spreadingFactor = sfDist (rng);
+      double transmissionPower = tpDist (rng);
+
+      //A quarter of the cases with a fractional power
+      bool fractional = fractionDist (rng) == 0;
+      if (fractional)
+        {
+          transmissionPower += 0.25 + 0.5 * std::generate_canonical<double, 53> (rng);
+        }
+
+      uint8_t sf = spreadingFactor;
+      double tp = transmissionPower;
+      AdrComponent::ApplyAdrSteps (steps, minSpreadingFactor,
+                                   minTransmissionPower, maxTransmissionPower,
+                                   &sf, &tp);
+
+      uint8_t referenceSf = spreadingFactor;
+      double referenceTp = transmissionPower;
+      ApplyAdrStepsReference (steps, minSpreadingFactor,
+                              minTransmissionPower, maxTransmissionPower,
+                              &referenceSf, &referenceTp);
+
+      //Integer powers must match exactly, fractional ones up to the
+      //rounding of the repeated 2 dB steps
+      bool tpEqual = fractional ? std::fabs (tp - referenceTp) < 1e-9 : tp == referenceTp;
+      if (sf != referenceSf || !tpEqual)
+        {
+          if (mismatches < 10)
+            {
+              std::cout << "mismatch: steps=" << steps
+                        << " minSf=" << minSpreadingFactor
+                        << " tpLimits=[" << minTransmissionPower << ", "
+                        << maxTransmissionPower << "]"
+                        << " sf=" << int (spreadingFactor)
+                        << " tp=" << transmissionPower
+                        << " -> closed form (" << int (sf) << ", " << tp
+                        << "), loops (" << int (referenceSf) << ", "
+                        << referenceTp << ")" << std::endl;
+            }
+          mismatches++;
+        }
+    }
+
+  std::cout << nCases << " cases, " << mismatches << " mismatches" << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,286 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (c) 2018 University of Padova
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Author: Matteo Perin <matteo.perin.2@studenti.unipd.it>
+ */
+
+/*
+ * Replay of a trace of recorded uplinks through the AdrComponent, without
+ * building an ns-3 topology.
+ *
+ * The trace is a binary file of little endian records, one per uplink, in
+ * the order they were received:
+ *
+ *   uint32_t deviceAddress
+ *   uint64_t timestamp           (us)
+ *   uint8_t  spreadingFactor
+ *   uint8_t  transmissionPower   (dBm)
+ *   uint8_t  adr                 (ADR bit of the frame header)
+ *   uint8_t  nGateways           (at least 1)
+ *   float    rxPower[nGateways]  (dBm, one per receiving gateway)
+ *
+ * The file is memory mapped and the records are fed to the component one
+ * at a time, at their timestamp. Every LinkAdrReq sent on a decision is
+ * written to the output as a "timestamp,deviceAddress,dataRate,txPower"
+ * line. As in BeforeSendingReply, commands are sent when the settings or
+ * the NbTrans of the device change, and MinCommandInterval holds back
+ * those too close to the previous one. DownlinkBudget is ignored: the
+ * records do not identify the gateways, so the one sending each reply is
+ * not known.
+ *
+ * The parameters of the algorithm are set through the attributes of the
+ * component, for instance --ns3::AdrComponent::HistoryAveraging=Ewma.
+ *
+ * Usage: adr-trace-replay --trace=uplinks.bin --output=decisions.csv
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/adr-component.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("AdrTraceReplay");
+
+//Size of the fixed part of a record
+static const size_t recordHeaderSize = 16;
+
+struct UplinkRecord
+{
+  uint32_t deviceAddress;
+  uint64_t timestamp;
+  uint8_t spreadingFactor;
+  uint8_t transmissionPower;
+  bool adr;
+  uint8_t nGateways;
+  //Start of the rxPower array, not necessarily aligned
+  const uint8_t *rxPower;
+};
+
+//Parse the record at offset, and return the offset of the next one, or 0
+//if the record is truncated
+static size_t
+ParseRecord (const uint8_t *data, size_t size, size_t offset, UplinkRecord *record)
+{
+  if (size - offset < recordHeaderSize)
+    {
+      return 0;
+    }
+
+  const uint8_t *p = data + offset;
+  std::memcpy (&record->deviceAddress, p, 4);
+  std::memcpy (&record->timestamp, p + 4, 8);
+  record->spreadingFactor = p[12];
+  record->transmissionPower = p[13];
+  record->adr = p[14];
+  record->nGateways = p[15];
+  record->rxPower = p + recordHeaderSize;
+
+  size_t next = offset + recordHeaderSize + record->nGateways * sizeof (float);
+  if (record->nGateways == 0 || next > size)
+    {
+      return 0;
+    }
+  return next;
+}
+
+//Write the decimal digits of value at p, and return the end of them.
+//Faster than printf, which would dominate the replay time.
+static char *
+AppendUnsigned (char *p, uint64_t value)
+{
+  char digits[20];
+  int n = 0;
+  do
+    {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+    }
+  while (value > 0);
+
+  while (n > 0)
+    {
+      *p++ = digits[--n];
+    }
+  return p;
+}
+
+int
+main (int argc, char *argv[])
+{
+  std::string tracePath;
+  std::string outputPath = "adr-decisions.csv";
+
+  CommandLine cmd;
+  cmd.AddValue ("trace", "Binary trace of uplinks to replay", tracePath);
+  cmd.AddValue ("output", "File the decisions are written to", outputPath);
+  cmd.Parse (argc, argv);
+
+  if (tracePath.empty ())
+    {
+      NS_FATAL_ERROR ("No trace given, use --trace");
+    }
+
+  int fd = open (tracePath.c_str (), O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat (fd, &info) != 0)
+    {
+      NS_FATAL_ERROR ("Cannot open " << tracePath);
+    }
+
+  size_t size = info.st_size;
+  const uint8_t *data = 0;
+  if (size > 0)
+    {
+      void *map = mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+        {
+          NS_FATAL_ERROR ("Cannot map " << tracePath);
+        }
+      data = static_cast<const uint8_t *> (map);
+      madvise (map, size, MADV_SEQUENTIAL);
+    }
+
+  FILE *output = std::fopen (outputPath.c_str (), "w");
+  if (!output)
+    {
+      NS_FATAL_ERROR ("Cannot open " << outputPath);
+    }
+
+  Ptr<AdrComponent> adr = CreateObject<AdrComponent> ();
+
+  //First pass: create the states of all the devices, so that no insertion
+  //happens while replaying
+  std::unordered_set<uint32_t> seen;
+  std::vector<uint32_t> devices;
+  UplinkRecord record;
+  size_t offset = 0;
+  size_t next;
+  while (offset < size && (next = ParseRecord (data, size, offset, &record)))
+    {
+      if (seen.insert (record.deviceAddress).second)
+        {
+          devices.push_back (record.deviceAddress);
+        }
+      offset = next;
+    }
+  if (offset != size)
+    {
+      NS_LOG_WARN ("Truncated record at offset " << offset << ", ignoring the rest of the trace");
+    }
+  size_t end = offset;
+
+  adr->RegisterDevices (devices);
+
+  //Second pass: replay
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+  uint64_t nUplinks = 0;
+  uint64_t nCommands = 0;
+  double rxPower[UINT8_MAX];
+
+  //Output buffer, flushed when less than a line is left
+  std::vector<char> buffer (1 << 20);
+  char *out = &buffer[0];
+  char *outEnd = out + buffer.size () - 64;
+
+  //The states of the devices do not fit in the cache for large networks:
+  //prefetch the one of the device prefetchDistance records ahead
+  const int prefetchDistance = 16;
+  UplinkRecord ahead;
+  size_t aheadOffset = 0;
+  for (int i = 0; i < prefetchDistance && aheadOffset < end; i++)
+    {
+      aheadOffset = ParseRecord (data, size, aheadOffset, &ahead);
+      adr->PrefetchDevice (ahead.deviceAddress);
+    }
+
+  offset = 0;
+  while (offset < end)
+    {
+      offset = ParseRecord (data, size, offset, &record);
+
+      if (aheadOffset < end)
+        {
+          aheadOffset = ParseRecord (data, size, aheadOffset, &ahead);
+          adr->PrefetchDevice (ahead.deviceAddress);
+        }
+
+      for (uint8_t g = 0; g < record.nGateways; g++)
+        {
+          float power;
+          std::memcpy (&power, record.rxPower + g * sizeof (float), sizeof (float));
+          rxPower[g] = power;
+        }
+
+      AdrComponent::AdrDecision decision =
+        adr->ReplayUplink (record.deviceAddress, record.timestamp * 1e-6,
+                           record.spreadingFactor,
+                           record.transmissionPower, record.adr,
+                           rxPower, record.nGateways);
+      nUplinks++;
+
+      //Leave out the decisions that do not result in a command
+      if (decision.command)
+        {
+          out = AppendUnsigned (out, record.timestamp);
+          *out++ = ',';
+          out = AppendUnsigned (out, record.deviceAddress);
+          *out++ = ',';
+          out = AppendUnsigned (out, decision.dataRate);
+          *out++ = ',';
+          out = AppendUnsigned (out, decision.txPower);
+          *out++ = '\n';
+          nCommands++;
+
+          if (out > outEnd)
+            {
+              std::fwrite (&buffer[0], 1, out - &buffer[0], output);
+              out = &buffer[0];
+            }
+        }
+    }
+  std::fwrite (&buffer[0], 1, out - &buffer[0], output);
+
+  std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now ();
+  double seconds = std::chrono::duration<double> (stop - start).count ();
+
+  std::fclose (output);
+  if (data)
+    {
+      munmap (const_cast<uint8_t *> (data), size);
+    }
+  close (fd);
+
+  std::cout << "uplinks " << nUplinks << " devices " << devices.size ()
+            << " commands " << nCommands << " time " << seconds << " s ("
+            << nUplinks / seconds << " uplinks/s)" << std::endl;
+  adr->GetStatistics ().Print (std::cout);
+
+  return 0;
+}